@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+# Compiles a GLSL shader to SPIR-V, optimizes it with spirv-opt when given,
+# and writes the words as a C initializer list for #include.
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--glslang', required=True)
+    parser.add_argument('--spirv-opt')
+    parser.add_argument('input')
+    parser.add_argument('output')
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        spv = os.path.join(tmp, 'shader.spv')
+        subprocess.run([args.glslang, '--quiet', '-V', '-o', spv, args.input],
+                       check=True)
+        if args.spirv_opt:
+            optimized = os.path.join(tmp, 'shader.opt.spv')
+            subprocess.run([args.spirv_opt, '-O', spv, '-o', optimized],
+                           check=True)
+            spv = optimized
+        with open(spv, 'rb') as f:
+            code = f.read()
+
+    if len(code) % 4:
+        sys.exit(f'{args.input}: SPIR-V size is not a multiple of 4')
+    words = struct.unpack(f'<{len(code) // 4}I', code)
+    with open(args.output, 'w') as f:
+        for i in range(0, len(words), 8):
+            f.write(','.join(f'0x{w:08x}' for w in words[i:i + 8]) + ',\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -5,10 +5,25 @@ layout(std140, set = 0, binding = 0) uniform block { uniform mat4 rotation; };
 layout(location = 0) in vec4 in_position;
 layout(location = 1) in vec4 in_color;
 
+// per instance: xy offset, xy scale
+layout(location = 2) in vec4 in_transform;
+layout(location = 3) in vec4 in_tint;
+
 layout(location = 0) out vec4 vVaryingColor;
 
+// 0: vertex color times instance tint, 1: vertex color, 2: instance tint.
+// Set per pipeline variant, see pipeline_variants in main.c.
+layout(constant_id = 0) const int color_mode = 0;
+
 void main() {
-  gl_Position = rotation * in_position;
-  gl_Position.z = 0.0;
-  vVaryingColor = vec4(in_color.rgba);
+  vec2 position = in_position.xy * in_transform.zw + in_transform.xy;
+  gl_Position = rotation * vec4(position, in_position.z, 1.0);
+  // +z points at the viewer, the depth range is [0, 1]
+  gl_Position.z = 0.5 - 0.5 * in_position.z;
+  if (color_mode == 1)
+    vVaryingColor = in_color;
+  else if (color_mode == 2)
+    vVaryingColor = in_tint;
+  else
+    vVaryingColor = in_color * in_tint;
 }
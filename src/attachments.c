@@ -0,0 +1,140 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "attachments.h"
+
+#include <assert.h>
+
+#include "util.h"
+
+static void create_image(struct attachments *a, struct allocator *allocator,
+                         VkFormat format, VkImageUsageFlags usage,
+                         VkImageAspectFlags aspect, uint32_t width,
+                         uint32_t height, VkImage *image, VkImageView *view,
+                         struct allocation *alloc) {
+    vkCreateImage(a->device,
+                  &(VkImageCreateInfo){
+                      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                      .imageType = VK_IMAGE_TYPE_2D,
+                      .format = format,
+                      .extent = {width, height, 1},
+                      .mipLevels = 1,
+                      .arrayLayers = 1,
+                      .samples = a->samples,
+                      .tiling = VK_IMAGE_TILING_OPTIMAL,
+                      .usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+                      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+                      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                  },
+                  NULL, image);
+
+    VkMemoryRequirements reqs;
+    vkGetImageMemoryRequirements(a->device, *image, &reqs);
+    bool ok = mem_alloc(allocator, &reqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, false, alloc);
+    assert(ok);
+    vkBindImageMemory(a->device, *image, alloc->memory, alloc->offset);
+
+    uint32_t type = alloc->block->type_index;
+    a->lazy &= (allocator->props.memoryTypes[type].propertyFlags &
+                VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != 0;
+    a->bytes += reqs.size;
+
+    vkCreateImageView(a->device,
+                      &(VkImageViewCreateInfo){
+                          .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                          .image = *image,
+                          .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                          .format = format,
+                          .subresourceRange =
+                              {
+                                  .aspectMask = aspect,
+                                  .levelCount = 1,
+                                  .layerCount = 1,
+                              },
+                      },
+                      NULL, view);
+}
+
+VkSampleCountFlagBits attachments_supported_samples(
+    VkPhysicalDevice physical_device, uint32_t samples, bool depth) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physical_device, &props);
+
+    VkSampleCountFlags counts = props.limits.framebufferColorSampleCounts;
+    if (depth)
+        counts &= props.limits.framebufferDepthSampleCounts;
+    // sample counts are single bits, 1 is always supported
+    while (samples > 1 && !(counts & samples))
+        samples >>= 1;
+    return MAX(samples, 1);
+}
+
+void attachments_create(struct attachments *a, VkDevice device,
+                        struct allocator *allocator, VkFormat color_format,
+                        uint32_t width, uint32_t height) {
+    a->device = device;
+    a->bytes = 0;
+    a->lazy = true;
+
+    if (a->samples > 1)
+        create_image(a, allocator, color_format,
+                     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                     VK_IMAGE_ASPECT_COLOR_BIT, width, height, &a->color,
+                     &a->color_view, &a->color_alloc);
+    if (a->depth_format != VK_FORMAT_UNDEFINED)
+        create_image(a, allocator, a->depth_format,
+                     VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                     VK_IMAGE_ASPECT_DEPTH_BIT, width, height, &a->depth,
+                     &a->depth_view, &a->depth_alloc);
+    a->lazy &= a->bytes > 0;
+}
+
+void attachments_destroy(struct attachments *a, struct allocator *allocator) {
+    if (a->color) {
+        vkDestroyImageView(a->device, a->color_view, NULL);
+        vkDestroyImage(a->device, a->color, NULL);
+        mem_free(allocator, &a->color_alloc);
+        a->color = VK_NULL_HANDLE;
+    }
+    if (a->depth) {
+        vkDestroyImageView(a->device, a->depth_view, NULL);
+        vkDestroyImage(a->device, a->depth, NULL);
+        mem_free(allocator, &a->depth_alloc);
+        a->depth = VK_NULL_HANDLE;
+    }
+}
+
+void attachments_retire(struct attachments *a, struct sync *sync,
+                        uint64_t value) {
+    if (a->color) {
+        sync_retire_image(sync, value, a->color, a->color_view,
+                          &a->color_alloc);
+        a->color = VK_NULL_HANDLE;
+    }
+    if (a->depth) {
+        sync_retire_image(sync, value, a->depth, a->depth_view,
+                          &a->depth_alloc);
+        a->depth = VK_NULL_HANDLE;
+    }
+}
+
+VkDeviceSize attachments_committed(const struct attachments *a) {
+    if (!a->lazy)
+        return a->bytes;
+
+    // both images may share a block
+    VkDeviceMemory memory[2];
+    uint32_t count = 0;
+    if (a->color)
+        memory[count++] = a->color_alloc.memory;
+    if (a->depth && (!count || memory[0] != a->depth_alloc.memory))
+        memory[count++] = a->depth_alloc.memory;
+
+    VkDeviceSize total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        VkDeviceSize committed;
+        vkGetDeviceMemoryCommitment(a->device, memory[i], &committed);
+        total += committed;
+    }
+    return total;
+}
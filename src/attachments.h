@@ -0,0 +1,47 @@
+#ifndef ATTACHMENTS_H
+#define ATTACHMENTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "memory.h"
+#include "sync.h"
+
+// The multisampled color and the depth attachment. Both live only inside
+// the render pass: MSAA resolves into the presented image at the end of
+// the subpass, and neither is stored. So they are transient, one pair is
+// shared by all framebuffers, and they sit in lazily allocated memory
+// where the device has it, which tilers never commit.
+struct attachments {
+    VkDevice device;
+    VkSampleCountFlagBits samples; // 1 without MSAA
+    VkFormat depth_format;         // VK_FORMAT_UNDEFINED without depth
+    VkImage color, depth;
+    VkImageView color_view, depth_view;
+    struct allocation color_alloc, depth_alloc;
+    VkDeviceSize bytes; // what the images asked for
+    bool lazy;          // bound to lazily allocated memory
+};
+
+// Clamps samples to what the device supports for color and, if depth is
+// set, for depth as well.
+VkSampleCountFlagBits attachments_supported_samples(
+    VkPhysicalDevice physical_device, uint32_t samples, bool depth);
+
+// Creates the images the settings ask for, none at all for 1 sample and
+// no depth.
+void attachments_create(struct attachments *a, VkDevice device,
+                        struct allocator *allocator, VkFormat color_format,
+                        uint32_t width, uint32_t height);
+void attachments_destroy(struct attachments *a, struct allocator *allocator);
+// Hands the images to sync for destruction once value is reached, and
+// leaves a ready for attachments_create().
+void attachments_retire(struct attachments *a, struct sync *sync,
+                        uint64_t value);
+
+// Bytes the driver has actually backed, which is less than bytes for lazily
+// allocated memory. Counts whole memory blocks.
+VkDeviceSize attachments_committed(const struct attachments *a);
+
+#endif
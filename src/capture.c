@@ -0,0 +1,288 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "capture.h"
+
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define BYTES_PER_PIXEL 4
+
+static void write_frame(struct capture *capture, struct capture_slot *slot,
+                        uint8_t **row, size_t *row_size) {
+    struct allocator *allocator = capture->allocator;
+    struct allocation *alloc = &slot->buffer.alloc;
+    uint32_t type_index = alloc->block->type_index;
+    size_t pitch = (size_t)slot->width * BYTES_PER_PIXEL;
+
+    if (!(allocator->props.memoryTypes[type_index].propertyFlags &
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+        // the block is mapped whole, so the range may run to its end
+        VkDeviceSize offset =
+            alloc->offset / capture->atom_size * capture->atom_size;
+        vkInvalidateMappedMemoryRanges(
+            capture->device, 1,
+            &(VkMappedMemoryRange){
+                .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+                .memory = alloc->memory,
+                .offset = offset,
+                .size = VK_WHOLE_SIZE,
+            });
+    }
+
+    const uint8_t *pixels = slot->buffer.map;
+    FILE *out = capture->out;
+    uint64_t bytes;
+    bool ok;
+    if (capture->format == CAPTURE_RAW) {
+        ok = fwrite(pixels, pitch, slot->height, out) == slot->height;
+        bytes = pitch * slot->height;
+    } else {
+        size_t rgb_pitch = (size_t)slot->width * 3;
+        if (*row_size < rgb_pitch) {
+            free(*row);
+            *row = malloc(rgb_pitch);
+            assert(*row);
+            *row_size = rgb_pitch;
+        }
+        int header = fprintf(out, "P6\n%u %u\n255\n", slot->width,
+                             slot->height);
+        ok = header > 0;
+        uint32_t r = capture->swap_red_blue ? 2 : 0;
+        for (uint32_t y = 0; ok && y < slot->height; y++) {
+            const uint8_t *src = pixels + y * pitch;
+            for (uint32_t x = 0; x < slot->width; x++) {
+                (*row)[x * 3 + 0] = src[x * 4 + r];
+                (*row)[x * 3 + 1] = src[x * 4 + 1];
+                (*row)[x * 3 + 2] = src[x * 4 + 2 - r];
+            }
+            ok = fwrite(*row, rgb_pitch, 1, out) == 1;
+        }
+        bytes = (uint64_t)header + rgb_pitch * slot->height;
+    }
+    if (ok)
+        capture->bytes_written += bytes;
+    else
+        capture->write_failed = true;
+}
+
+static void *writer_main(void *data) {
+    struct capture *capture = data;
+    uint8_t *row = NULL;
+    size_t row_size = 0;
+
+    pthread_mutex_lock(&capture->lock);
+    for (;;) {
+        while (!capture->count && !capture->quit)
+            pthread_cond_wait(&capture->queued, &capture->lock);
+        if (!capture->count)
+            break;
+        struct capture_slot *slot = &capture->slots[capture->head];
+        pthread_mutex_unlock(&capture->lock);
+
+        vkWaitSemaphores(capture->device,
+                         &(VkSemaphoreWaitInfo){
+                             .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+                             .semaphoreCount = 1,
+                             .pSemaphores = &capture->timeline,
+                             .pValues = &slot->value,
+                         },
+                         UINT64_MAX);
+        // after a failed write, frames are still retired but not written
+        if (!capture->write_failed)
+            write_frame(capture, slot, &row, &row_size);
+
+        pthread_mutex_lock(&capture->lock);
+        capture->head = (capture->head + 1) % NUM_CAPTURE_SLOTS;
+        capture->count--;
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    free(row);
+    return NULL;
+}
+
+bool capture_init(struct capture *capture, VkPhysicalDevice physical_device,
+                  struct allocator *allocator, VkSemaphore timeline,
+                  VkFormat image_format, const char *path,
+                  enum capture_format format) {
+    memset(capture, 0, sizeof(*capture));
+    capture->device = allocator->device;
+    capture->allocator = allocator;
+    capture->timeline = timeline;
+    capture->format = format;
+
+    switch (image_format) {
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+        capture->swap_red_blue = true;
+        break;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+        break;
+    default:
+        assert(!"unsupported capture format");
+    }
+
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physical_device, &props);
+    capture->atom_size = MAX(props.limits.nonCoherentAtomSize, 1);
+
+    if (path[0] == '|') {
+        // a consumer that goes away must not kill the renderer, the
+        // failed write is reported instead
+        signal(SIGPIPE, SIG_IGN);
+        capture->out = popen(path + 1, "w");
+        capture->pipe = true;
+    } else {
+        capture->out = fopen(path, "wb");
+    }
+    if (!capture->out)
+        return false;
+
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_cond_init(&capture->queued, NULL);
+    pthread_create(&capture->thread, NULL, writer_main, capture);
+    return true;
+}
+
+void capture_finish(struct capture *capture) {
+    assert(!capture->recorded);
+
+    pthread_mutex_lock(&capture->lock);
+    capture->quit = true;
+    pthread_cond_signal(&capture->queued);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->thread, NULL);
+    pthread_cond_destroy(&capture->queued);
+    pthread_mutex_destroy(&capture->lock);
+
+    for (uint32_t i = 0; i < NUM_CAPTURE_SLOTS; i++) {
+        struct capture_slot *slot = &capture->slots[i];
+        if (slot->buffer.buffer)
+            destroy_buffer(capture->allocator, &slot->buffer);
+    }
+
+    if (capture->pipe)
+        pclose(capture->out);
+    else
+        fclose(capture->out);
+}
+
+bool capture_record(struct capture *capture, VkCommandBuffer cmd,
+                    VkImage image, VkImageLayout layout, uint32_t width,
+                    uint32_t height) {
+    assert(!capture->recorded);
+
+    pthread_mutex_lock(&capture->lock);
+    uint32_t head = capture->head, count = capture->count;
+    pthread_mutex_unlock(&capture->lock);
+    if (count == NUM_CAPTURE_SLOTS) {
+        capture->frames_dropped++;
+        return false;
+    }
+
+    // not queued, so the writer is done with it
+    struct capture_slot *slot =
+        &capture->slots[(head + count) % NUM_CAPTURE_SLOTS];
+    VkDeviceSize size = (VkDeviceSize)width * height * BYTES_PER_PIXEL;
+    if (slot->buffer.size < size) {
+        if (slot->buffer.buffer)
+            destroy_buffer(capture->allocator, &slot->buffer);
+        // the CPU reads every byte, which is slow from uncached memory, so
+        // a cached type wins even if it is not coherent
+        slot->buffer = create_buffer(capture->allocator, size,
+                                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_CACHED_BIT |
+                                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+    slot->width = width;
+    slot->height = height;
+
+    VkImageSubresourceRange range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1,
+    };
+    // The render pass makes its writes visible to transfer reads, see its
+    // external dependency, which this chains to.
+    if (layout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL)
+        vkCmdPipelineBarrier(
+            cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
+            &(VkImageMemoryBarrier){
+                .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                .srcAccessMask = 0,
+                .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+                .oldLayout = layout,
+                .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image = image,
+                .subresourceRange = range,
+            });
+
+    vkCmdCopyImageToBuffer(
+        cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot->buffer.buffer,
+        1,
+        &(VkBufferImageCopy){
+            .imageSubresource =
+                {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .layerCount = 1,
+                },
+            .imageExtent = {width, height, 1},
+        });
+
+    // Makes the copy visible to the writer's reads once the timeline has
+    // reached the frame, and hands the image back for presentation. The present
+    // waits on a semaphore, so no stage has to wait for the transition.
+    uint32_t image_barriers =
+        layout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL ? 1 : 0;
+    vkCmdPipelineBarrier(
+        cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+        0, NULL, 1,
+        &(VkBufferMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer = slot->buffer.buffer,
+            .size = VK_WHOLE_SIZE,
+        },
+        image_barriers,
+        &(VkImageMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = 0,
+            .dstAccessMask = 0,
+            .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            .newLayout = layout,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = image,
+            .subresourceRange = range,
+        });
+
+    capture->recorded = true;
+    return true;
+}
+
+void capture_submit(struct capture *capture, uint64_t value) {
+    if (!capture->recorded)
+        return;
+    capture->recorded = false;
+
+    pthread_mutex_lock(&capture->lock);
+    uint32_t tail = (capture->head + capture->count) % NUM_CAPTURE_SLOTS;
+    capture->slots[tail].value = value;
+    capture->count++;
+    capture->frames_captured++;
+    pthread_cond_signal(&capture->queued);
+    pthread_mutex_unlock(&capture->lock);
+}
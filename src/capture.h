@@ -0,0 +1,76 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vulkan/vulkan.h>
+
+#include "memory.h"
+
+#define NUM_CAPTURE_SLOTS 8
+
+enum capture_format {
+    CAPTURE_PPM,
+    CAPTURE_RAW,
+};
+
+// One frame in flight to the writer, which waits for the timeline to reach
+// value before it reads the buffer.
+struct capture_slot {
+    struct buffer buffer;
+    uint64_t value;
+    uint32_t width, height;
+};
+
+// Reads frames back without stalling the renderer. Each frame is copied
+// into the next slot of a ring of host-cached buffers, and a writer thread
+// waits for the copy and streams it out. When the writer falls behind, the
+// ring is full and frames are dropped rather than waited for.
+struct capture {
+    VkDevice device;
+    struct allocator *allocator;
+    VkSemaphore timeline; // waited on directly, struct sync is not shared
+    VkDeviceSize atom_size; // for invalidating non-coherent memory
+    FILE *out;
+    bool pipe;
+    enum capture_format format;
+    bool swap_red_blue; // PPM is RGB
+
+    struct capture_slot slots[NUM_CAPTURE_SLOTS];
+    // queued slots are [head, head + count), in submission order
+    uint32_t head, count;
+    bool recorded; // the slot at head + count holds an unsubmitted copy
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    bool quit;
+    bool write_failed;
+
+    uint64_t frames_captured, frames_dropped;
+    uint64_t bytes_written;
+};
+
+// path names a file, or a command to pipe to when it starts with '|'.
+// Returns false if the output cannot be opened.
+bool capture_init(struct capture *capture, VkPhysicalDevice physical_device,
+                  struct allocator *allocator, VkSemaphore timeline,
+                  VkFormat image_format, const char *path,
+                  enum capture_format format);
+// Writes out everything still queued.
+void capture_finish(struct capture *capture);
+
+// Records a copy of image, which must have TRANSFER_SRC usage, into cmd
+// after the render pass that wrote it. The image is used in layout and left
+// in it. Returns false and counts a dropped frame if no slot is free.
+bool capture_record(struct capture *capture, VkCommandBuffer cmd,
+                    VkImage image, VkImageLayout layout, uint32_t width,
+                    uint32_t height);
+
+// Hands the recorded copy to the writer. value is the timeline value the
+// submit of the command buffer passed to capture_record() signals.
+void capture_submit(struct capture *capture, uint64_t value);
+
+#endif
@@ -0,0 +1,276 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cull.h"
+
+#include <assert.h>
+
+#include "util.h"
+
+#define GROUP_SIZE 64 // local_size_x in cull.comp
+
+static uint32_t cs_spirv_source[] = {
+#include "cull.comp.spv"
+};
+
+void culler_init(struct culler *culler, VkPhysicalDevice physical_device,
+                 VkDevice device, struct allocator *allocator,
+                 VkPipelineCache pipeline_cache, VkBuffer uniforms,
+                 VkDeviceSize uniform_range, uint32_t object_count,
+                 uint32_t slot_count, bool draw_indirect_count) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physical_device, &props);
+    VkDeviceSize alignment = props.limits.minStorageBufferOffsetAlignment;
+
+    *culler = (struct culler){
+        .device = device,
+        .object_count = object_count,
+        .max_group_count = props.limits.maxComputeWorkGroupCount[0],
+        .commands_stride = ALIGN_UP(
+            (VkDeviceSize)object_count * sizeof(VkDrawIndirectCommand),
+            alignment),
+        .count_stride = ALIGN_UP(sizeof(uint32_t), alignment),
+    };
+    if (draw_indirect_count)
+        culler->draw_indirect_count =
+            (PFN_vkCmdDrawIndirectCountKHR)vkGetDeviceProcAddr(
+                device, "vkCmdDrawIndirectCountKHR");
+
+    culler->bounds = create_buffer(
+        allocator, (VkDeviceSize)object_count * sizeof(struct bounds),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+    culler->commands = create_buffer(
+        allocator, slot_count * culler->commands_stride,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+    culler->count = create_buffer(
+        allocator, slot_count * culler->count_stride,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+
+    vkCreateDescriptorSetLayout(
+        device,
+        &(VkDescriptorSetLayoutCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .bindingCount = 4,
+            .pBindings =
+                (VkDescriptorSetLayoutBinding[]){
+                    {
+                        .binding = 0,
+                        .descriptorType =
+                            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                        .descriptorCount = 1,
+                        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                    },
+                    {
+                        .binding = 1,
+                        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                        .descriptorCount = 1,
+                        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                    },
+                    {
+                        .binding = 2,
+                        .descriptorType =
+                            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                        .descriptorCount = 1,
+                        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                    },
+                    {
+                        .binding = 3,
+                        .descriptorType =
+                            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                        .descriptorCount = 1,
+                        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                    },
+                },
+        },
+        NULL, &culler->set_layout);
+
+    vkCreatePipelineLayout(
+        device,
+        &(VkPipelineLayoutCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount = 1,
+            .pSetLayouts = &culler->set_layout,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges =
+                &(VkPushConstantRange){
+                    .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .size = sizeof(uint32_t),
+                },
+        },
+        NULL, &culler->pipeline_layout);
+
+    VkShaderModule cs_module;
+    vkCreateShaderModule(
+        device,
+        &(VkShaderModuleCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+            .codeSize = sizeof(cs_spirv_source),
+            .pCode = cs_spirv_source,
+        },
+        NULL, &cs_module);
+
+    vkCreateComputePipelines(
+        device, pipeline_cache, 1,
+        &(VkComputePipelineCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage =
+                {
+                    .sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .module = cs_module,
+                    .pName = "main",
+                },
+            .layout = culler->pipeline_layout,
+        },
+        NULL, &culler->pipeline);
+    vkDestroyShaderModule(device, cs_module, NULL);
+
+    vkCreateDescriptorPool(
+        device,
+        &(VkDescriptorPoolCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .maxSets = 1,
+            .poolSizeCount = 3,
+            .pPoolSizes =
+                (VkDescriptorPoolSize[]){
+                    {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1},
+                    {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1},
+                    {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 2},
+                },
+        },
+        NULL, &culler->desc_pool);
+
+    vkAllocateDescriptorSets(
+        device,
+        &(VkDescriptorSetAllocateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = culler->desc_pool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &culler->set_layout,
+        },
+        &culler->desc_set);
+
+    vkUpdateDescriptorSets(
+        device, 4,
+        (VkWriteDescriptorSet[]){
+            {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = culler->desc_set,
+                .dstBinding = 0,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                .pBufferInfo =
+                    &(VkDescriptorBufferInfo){uniforms, 0, uniform_range},
+            },
+            {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = culler->desc_set,
+                .dstBinding = 1,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &(VkDescriptorBufferInfo){culler->bounds.buffer,
+                                                         0, VK_WHOLE_SIZE},
+            },
+            {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = culler->desc_set,
+                .dstBinding = 2,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                .pBufferInfo =
+                    &(VkDescriptorBufferInfo){culler->commands.buffer, 0,
+                                              culler->commands_stride},
+            },
+            {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = culler->desc_set,
+                .dstBinding = 3,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                .pBufferInfo = &(VkDescriptorBufferInfo){
+                    culler->count.buffer, 0, sizeof(uint32_t)},
+            },
+        },
+        0, NULL);
+}
+
+void culler_finish(struct culler *culler, struct allocator *allocator) {
+    if (!culler->device)
+        return;
+    vkDestroyPipeline(culler->device, culler->pipeline, NULL);
+    vkDestroyPipelineLayout(culler->device, culler->pipeline_layout, NULL);
+    vkDestroyDescriptorPool(culler->device, culler->desc_pool, NULL);
+    vkDestroyDescriptorSetLayout(culler->device, culler->set_layout, NULL);
+    destroy_buffer(allocator, &culler->bounds);
+    destroy_buffer(allocator, &culler->commands);
+    destroy_buffer(allocator, &culler->count);
+}
+
+void cull_record(struct culler *culler, VkCommandBuffer cmd, uint32_t slot,
+                 uint32_t uniform_offset) {
+    VkDeviceSize commands_offset = slot * culler->commands_stride;
+    VkDeviceSize count_offset = slot * culler->count_stride;
+
+    // Culled objects leave their command untouched, so without a count
+    // buffer the commands start out as empty draws. The previous user of
+    // this slot completed before the frame was recorded.
+    vkCmdFillBuffer(cmd, culler->count.buffer, count_offset,
+                    sizeof(uint32_t), 0);
+    if (!culler->draw_indirect_count)
+        vkCmdFillBuffer(cmd, culler->commands.buffer, commands_offset,
+                        culler->commands_stride, 0);
+    vkCmdPipelineBarrier(
+        cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+        &(VkMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask =
+                VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+        },
+        0, NULL, 0, NULL);
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, culler->pipeline);
+    vkCmdBindDescriptorSets(
+        cmd, VK_PIPELINE_BIND_POINT_COMPUTE, culler->pipeline_layout, 0, 1,
+        &culler->desc_set, 3,
+        (uint32_t[]){uniform_offset, commands_offset, count_offset});
+    vkCmdPushConstants(cmd, culler->pipeline_layout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t),
+                       &culler->object_count);
+
+    uint32_t groups = (culler->object_count + GROUP_SIZE - 1) / GROUP_SIZE;
+    uint32_t groups_x = MIN(groups, culler->max_group_count);
+    vkCmdDispatch(cmd, groups_x, (groups + groups_x - 1) / groups_x, 1);
+
+    vkCmdPipelineBarrier(
+        cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1,
+        &(VkMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+        },
+        0, NULL, 0, NULL);
+}
+
+void cull_draw(struct culler *culler, VkCommandBuffer cmd, uint32_t slot) {
+    VkDeviceSize commands_offset = slot * culler->commands_stride;
+
+    if (culler->draw_indirect_count)
+        culler->draw_indirect_count(
+            cmd, culler->commands.buffer, commands_offset,
+            culler->count.buffer, slot * culler->count_stride,
+            culler->object_count, sizeof(VkDrawIndirectCommand));
+    else
+        vkCmdDrawIndirect(cmd, culler->commands.buffer, commands_offset,
+                          culler->object_count,
+                          sizeof(VkDrawIndirectCommand));
+}
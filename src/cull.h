@@ -0,0 +1,60 @@
+#ifndef CULL_H
+#define CULL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "memory.h"
+
+// Bounding circle of one object, as read by cull.comp.
+struct bounds {
+    float center[2];
+    float radius;
+    float pad;
+};
+
+// GPU-driven culling: a compute pass tests every object against the view
+// and writes one VkDrawIndirectCommand per visible object, plus their
+// count. The CPU records the same few commands no matter how many objects
+// there are. Commands and count have one region per slot, like the
+// uniform ring.
+struct culler {
+    VkDevice device;
+    VkDescriptorSetLayout set_layout;
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+    VkDescriptorPool desc_pool;
+    VkDescriptorSet desc_set;
+
+    struct buffer bounds;   // filled by the caller, see struct bounds
+    struct buffer commands; // VkDrawIndirectCommand per object and slot
+    struct buffer count;
+    VkDeviceSize commands_stride, count_stride;
+    uint32_t object_count;
+    uint32_t max_group_count;
+
+    // without VK_KHR_draw_indirect_count every object gets a command,
+    // zeroed out when culled
+    PFN_vkCmdDrawIndirectCountKHR draw_indirect_count;
+};
+
+// uniforms is bound with the same dynamic offsets as in the graphics
+// pipeline. The bounds buffer is device local; upload it before the first
+// frame.
+void culler_init(struct culler *culler, VkPhysicalDevice physical_device,
+                 VkDevice device, struct allocator *allocator,
+                 VkPipelineCache pipeline_cache, VkBuffer uniforms,
+                 VkDeviceSize uniform_range, uint32_t object_count,
+                 uint32_t slot_count, bool draw_indirect_count);
+void culler_finish(struct culler *culler, struct allocator *allocator);
+
+// Records the culling pass for slot. Must be outside of a render pass.
+void cull_record(struct culler *culler, VkCommandBuffer cmd, uint32_t slot,
+                 uint32_t uniform_offset);
+
+// Draws what the culling pass of slot left visible. Vertex buffers and the
+// graphics pipeline have to be bound already.
+void cull_draw(struct culler *culler, VkCommandBuffer cmd, uint32_t slot);
+
+#endif
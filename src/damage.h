@@ -0,0 +1,40 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Pixel rectangle [x0, x1) x [y0, y1), empty unless x0 < x1 and y0 < y1.
+struct rect {
+    int32_t x0, y0, x1, y1;
+};
+
+static inline bool rect_empty(struct rect r) {
+    return r.x0 >= r.x1 || r.y0 >= r.y1;
+}
+
+// Bounding box of both, which is what a single scissor can cover.
+static inline struct rect rect_union(struct rect a, struct rect b) {
+    if (rect_empty(a))
+        return b;
+    if (rect_empty(b))
+        return a;
+    return (struct rect){
+        a.x0 < b.x0 ? a.x0 : b.x0,
+        a.y0 < b.y0 ? a.y0 : b.y0,
+        a.x1 > b.x1 ? a.x1 : b.x1,
+        a.y1 > b.y1 ? a.y1 : b.y1,
+    };
+}
+
+static inline struct rect rect_clamp(struct rect r, int32_t width,
+                                     int32_t height) {
+    return (struct rect){
+        r.x0 > 0 ? r.x0 : 0,
+        r.y0 > 0 ? r.y0 : 0,
+        r.x1 < width ? r.x1 : width,
+        r.y1 < height ? r.y1 : height,
+    };
+}
+
+#endif
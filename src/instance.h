@@ -0,0 +1,15 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <stdint.h>
+
+// Per-instance vertex attributes, fed through vertex binding 1.
+struct instance {
+    float transform[4]; // x, y offset followed by x, y scale
+    uint8_t color[4];   // RGBA, multiplied with the vertex color
+};
+
+// animate.comp writes this layout as well
+_Static_assert(sizeof(struct instance) == 20, "layout used by animate.comp");
+
+#endif
@@ -1,64 +1,256 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <presentation-time-protocol.h>
 #include <xdg-shell-protocol.h>
 
 #define VK_USE_PLATFORM_WAYLAND_KHR
 #define VK_PROTOTYPES
 #include <vulkan/vulkan.h>
 
-#define MAX(x, y) ((x) > (y) ? (x) : (y))
-#define MIN(x, y) ((x) < (y) ? (x) : (y))
-#define MAX_NUM_IMAGES 4
+#include "attachments.h"
+#include "capture.h"
+#include "cull.h"
+#include "damage.h"
+#include "instance.h"
+#include "memory.h"
+#include "mesh.h"
+#include "pacer.h"
+#include "pipeline_cache.h"
+#include "presentation.h"
+#include "profiler.h"
+#include "simulation.h"
+#include "stats.h"
+#include "sync.h"
+#include "thread_pool.h"
+#include "upload.h"
+#include "util.h"
+#include "vertex_format.h"
+
+#define MAX_FRAMES_IN_FLIGHT 4
+// room for the offscreen images, one more than frames in flight
+#define MAX_NUM_IMAGES (MAX_FRAMES_IN_FLIGHT + 1)
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+#define NUM_OFFSCREEN_IMAGES 3
+// One uniform slice per frame in flight. Sized for swapchain images as well,
+// so a slice can also be tied to the image a command buffer renders to.
+#define NUM_UNIFORM_SLICES MAX(MAX_FRAMES_IN_FLIGHT, MAX_NUM_IMAGES)
+#define MAX_RECORD_THREADS 16
+#define MAX_INSTANCES (16u << 20)
+// mesh data streamed per frame, small enough to leave the rest of the
+// staging ring to other uploads
+#define MESH_BYTES_PER_FRAME (4u << 20)
+#define DEFAULT_HEADLESS_FRAMES 1000
+#define MAX_WINDOWS 64
+
+struct options {
+    bool headless;
+    uint32_t frames; // 0 renders until the compositor goes away
+    uint32_t frames_in_flight;
+    int width, height;
+    const char *trace_path;
+    const char *stats_path;
+    uint32_t warmup_frames;
+    uint32_t instances;
+    bool separate_draws;
+    bool cached_commands;
+    VkPresentModeKHR present_mode;
+    uint32_t swapchain_images; // 0 for the surface minimum
+    uint32_t fps; // headless frame rate, 0 for as fast as possible
+    bool pacing;
+    uint32_t threads;
+    bool cull;
+    float zoom;
+    bool simulate;
+    const char *mesh_path;
+    uint32_t variant;
+    uint32_t cycle_variants;
+    uint32_t msaa;
+    bool depth;
+    bool damage;
+    uint32_t blink_ms;
+    const char *capture_path;
+    enum capture_format capture_format;
+    uint32_t windows;
+};
+
+// Attribute formats of each row of VERTEX_FORMATS.
+#define VERTEX_ATTRIBUTES(name, format, stride, position, color, offset)       \
+    [format] = {VK_FORMAT_##position, VK_FORMAT_##color},
+static const struct {
+    VkFormat position, color;
+} vertex_formats[] = {VERTEX_FORMATS(VERTEX_ATTRIBUTES)};
+#undef VERTEX_ATTRIBUTES
+
+// Graphics pipeline variants: the color_mode specialization constant of
+// triangle.vert times the face culling mode.
+static const struct {
+    const char *name;
+    int32_t color_mode;
+    VkCullModeFlags cull_mode;
+} pipeline_variants[] = {
+    {"modulate", 0, VK_CULL_MODE_NONE},
+    {"vertex", 1, VK_CULL_MODE_NONE},
+    {"tint", 2, VK_CULL_MODE_NONE},
+    {"modulate-cull-back", 0, VK_CULL_MODE_BACK_BIT},
+    {"vertex-cull-back", 1, VK_CULL_MODE_BACK_BIT},
+    {"tint-cull-back", 2, VK_CULL_MODE_BACK_BIT},
+};
+#define NUM_PIPELINE_VARIANTS ARRAY_LENGTH(pipeline_variants)
+
+static const struct {
+    const char *name;
+    VkPresentModeKHR mode;
+} present_modes[] = {
+    {"fifo", VK_PRESENT_MODE_FIFO_KHR},
+    {"fifo-relaxed", VK_PRESENT_MODE_FIFO_RELAXED_KHR},
+    {"mailbox", VK_PRESENT_MODE_MAILBOX_KHR},
+    {"immediate", VK_PRESENT_MODE_IMMEDIATE_KHR},
+};
+
+static const char *present_mode_name(VkPresentModeKHR mode) {
+    for (size_t i = 0; i < ARRAY_LENGTH(present_modes); i++)
+        if (present_modes[i].mode == mode)
+            return present_modes[i].name;
+    return "unknown";
+}
 
 struct window_buffer {
     VkImage image;
+    struct allocation alloc; // only set for offscreen images
     VkImageView view;
     VkFramebuffer framebuffer;
-    VkFence cmd_fence;
-    VkCommandBuffer cmd_buffer;
+    uint64_t value; // timeline value of the frame that last rendered to it
+    struct rect damage; // changed since this image was last rendered
+    VkCommandBuffer cmd_buffer; // only set with cached command buffers
 };
 
-struct buffer {
-    VkBuffer buffer;
-    VkDeviceMemory memory;
-    VkDeviceSize size;
-    void *map;
+struct frame {
+    uint64_t value; // on the timeline, 0 before the first use of the slot
+    // one of each per window, by window id
+    VkSemaphore image_semaphores[MAX_WINDOWS];
+    VkSemaphore render_semaphores[MAX_WINDOWS];
+    VkCommandBuffer cmd_buffers[MAX_WINDOWS];
+    // one pool per recording job, with a secondary command buffer for each
+    // window; reset all at once when the frame starts recording
+    VkCommandPool job_pools[MAX_RECORD_THREADS];
+    VkCommandBuffer job_cmd_buffers[MAX_WINDOWS][MAX_RECORD_THREADS];
 };
 
+// Everything the windows share: device, pipelines, the scene and the
+// frames, each of which renders a batch of windows.
 struct vk {
-    VkSwapchainKHR swap_chain;
     VkInstance instance;
     VkPhysicalDevice physical_device;
-    VkPhysicalDeviceMemoryProperties memory_properties;
+    struct allocator allocator;
+    struct sync sync;
+    struct uploader uploader;
     VkDevice device;
     VkRenderPass render_pass;
+    VkRenderPass partial_render_pass; // keeps the image outside the area
+    uint32_t msaa; // requested samples, samples is what we got
+    bool depth;
+    VkSampleCountFlagBits samples;
+    VkFormat depth_format; // VK_FORMAT_UNDEFINED without depth
     VkQueue queue;
+    VkQueue transfer_queue;
+    VkQueue compute_queue;
+    uint32_t queue_family;
+    uint32_t transfer_family;
+    uint32_t compute_family;
     VkPipelineLayout pipeline_layout;
-    VkPipeline pipeline;
+    VkShaderModule vs_module, fs_module;
+    VkPipeline pipelines[NUM_PIPELINE_VARIANTS];
+    atomic_bool pipeline_ready[NUM_PIPELINE_VARIANTS];
+    uint32_t variant; // the one draws use
+    uint32_t cycle_frames, frames_since_cycle; // 0 keeps one variant
+    struct thread_pool compile_pool;
+    atomic_uint variants_left;
+    uint64_t pipelines_start_ns, variants_done_ns;
+    VkPipelineCache pipeline_cache;
     VkDescriptorSetLayout desc_set_layout;
     VkDescriptorSet desc_set;
-    VkSemaphore image_semaphore;
-    VkSemaphore render_semaphore;
     VkCommandPool cmd_pool;
-    VkSurfaceKHR surface;
-    VkFormat image_format;
-    uint32_t image_count;
-    struct buffer vert_buffer, uniform_buffer;
+    VkFormat image_format; // of all windows, so they share the render pass
+    bool headless;
+    struct buffer vert_buffer, uniform_buffer, instance_buffer;
+    VkDeviceSize uniform_stride; // slice size in the uniform ring
+    uint32_t instance_count;
+    bool separate_draws; // one draw call per instance instead of one in total
+    bool cached_commands; // per-image command buffers, recorded once
+    uint32_t record_threads; // 0 records on the main thread
+    bool cull; // GPU culling with indirect draws
+    bool draw_indirect_count;
+    struct culler culler;
+    float zoom;
+    uint32_t grid_side;
+    float grid_cell;
+    bool simulate; // animate the instances on the compute queue
+    struct simulation sim;
+    uint64_t start_ns;
+    const char *mesh_path; // draw this instead of the built-in triangle
+    struct mesh mesh;
+    struct thread_pool record_pool;
     VkDescriptorPool desc_pool;
-    struct window_buffer win_buffers[MAX_NUM_IMAGES];
+    struct frame frames[MAX_FRAMES_IN_FLIGHT];
+    uint32_t frame_count;
+    uint32_t frame_index;
+    struct profiler profiler;
+
+    // only redraw what changed, see update_scene()
+    bool track_damage;
+    bool incremental_present;
+    uint32_t blink_ms; // period of the blinking instance, 0 for none
+    uint64_t next_blink_ns;
+    bool blink_on, blink_update;
+    uint32_t frames_skipped, frames_partial;
+    uint64_t pixels_rendered;
+
+    const char *capture_path; // read the first window's frames back to this
+    enum capture_format capture_format;
+    struct capture capture;
 };
 
 struct window {
     struct display *display;
+    uint32_t id; // index into the per-window arrays of struct frame
     struct wl_surface *wl_surface;
     struct xdg_surface *xdg_surface;
     struct xdg_toplevel *xdg_toplevel;
     int width, height;
+    int pending_width, pending_height; // from the last toplevel configure
     bool wait_for_configure;
-    struct vk vk;
+    bool closed;
+    struct wl_callback *frame_callback; // pending until the compositor is
+                                        // ready for the next frame
+
+    VkSurfaceKHR surface;
+    VkSwapchainKHR swap_chain;
+    VkPresentModeKHR present_mode;
+    uint32_t image_count;
+    uint32_t next_image; // round-robin index of offscreen images
+    struct window_buffer win_buffers[MAX_NUM_IMAGES];
+    struct attachments attachments;
+    bool swapchain_stale; // recreate before the next acquire
+    bool commands_valid;
+
+    struct rect pending_damage; // changed since the last rendered frame
+    VkRect2D render_area;       // of the frame being recorded
+    bool partial_frame;
 };
 
 struct display {
@@ -66,7 +258,16 @@ struct display {
     struct wl_registry *wl_registory;
     struct wl_compositor *wl_compositor;
     struct xdg_wm_base *xdg_wm_base;
-    struct window window;
+    struct presentation presentation;
+    struct pacer pacer;
+    struct options options;
+    struct series frame_times;
+    uint64_t last_frame_ns;
+    uint64_t start_ns, first_frame_ns;
+    uint32_t frames_done;
+    struct vk vk;
+    struct window windows[MAX_WINDOWS];
+    uint32_t window_count;
 };
 
 static uint32_t vs_spirv_source[] = {
@@ -100,6 +301,8 @@ static void registry_handle_global(void *data, struct wl_registry *registry,
             wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
         xdg_wm_base_add_listener(display->xdg_wm_base, &xdg_wm_base_listener,
                                  display);
+    } else if (strcmp(interface, "wp_presentation") == 0) {
+        presentation_bind(&display->presentation, registry, name, version);
     }
 }
 static const struct wl_registry_listener wl_registry_listener = {
@@ -113,120 +316,70 @@ static void xdg_surface_handle_configure(void *data,
     struct window *window = data;
     xdg_surface_ack_configure(xdg_surface, serial);
     window->wait_for_configure = false;
+
+    // 0 leaves the size up to us
+    if (window->pending_width > 0 && window->pending_height > 0 &&
+        (window->pending_width != window->width ||
+         window->pending_height != window->height)) {
+        window->width = window->pending_width;
+        window->height = window->pending_height;
+        window->swapchain_stale = true;
+    }
 }
 static const struct xdg_surface_listener xdg_surface_listener = {
     .configure = xdg_surface_handle_configure,
 };
 
-struct buffer create_buffer(struct vk *vk, VkDeviceSize size,
-                            VkBufferUsageFlags usage_flags,
-                            VkMemoryPropertyFlagBits properties, bool map) {
-    struct buffer buffer;
-
-    buffer.size = size;
-    vkCreateBuffer(vk->device,
-                   &(VkBufferCreateInfo){
-                       .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                       .size = size,
-                       .usage = usage_flags,
-                   },
-                   NULL, &buffer.buffer);
-    VkMemoryRequirements reqs;
-    vkGetBufferMemoryRequirements(vk->device, buffer.buffer, &reqs);
-
-    unsigned int mem_type = UINT_MAX;
-    for (unsigned int i = 0; i < vk->memory_properties.memoryTypeCount; i++) {
-        // iterate over possible memory types for the buffer
-        if (!(reqs.memoryTypeBits & (1u << i)))
-            continue;
-        // search for memory type which matches the demanded propeties
-        if (vk->memory_properties.memoryTypes[i].propertyFlags & properties) {
-            mem_type = i;
-            break;
-        }
-    }
-    assert(mem_type != UINT_MAX);
-
-    vkAllocateMemory(vk->device,
-                     &(VkMemoryAllocateInfo){
-                         .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                         .allocationSize = MAX(size, reqs.size),
-                         .memoryTypeIndex = mem_type,
-                     },
-                     NULL, &buffer.memory);
-
-    vkBindBufferMemory(vk->device, buffer.buffer, buffer.memory, 0);
-
-    if (map)
-        vkMapMemory(vk->device, buffer.memory, 0, size, 0, &buffer.map);
-
-    return buffer;
+static void xdg_toplevel_handle_configure(void *data,
+                                          struct xdg_toplevel *xdg_toplevel,
+                                          int32_t width, int32_t height,
+                                          struct wl_array *states) {
+    struct window *window = data;
+    // applied once the surface configure completes the sequence
+    window->pending_width = width;
+    window->pending_height = height;
+}
+static void xdg_toplevel_handle_close(void *data,
+                                      struct xdg_toplevel *xdg_toplevel) {
+    struct window *window = data;
+    window->closed = true;
 }
+static const struct xdg_toplevel_listener xdg_toplevel_listener = {
+    .configure = xdg_toplevel_handle_configure,
+    .close = xdg_toplevel_handle_close,
+};
 
-static void init_vulkan(struct window *window) {
+static bool has_instance_layer(const char *name) {
     uint32_t count;
+    vkEnumerateInstanceLayerProperties(&count, NULL);
+    VkLayerProperties layers[count];
+    vkEnumerateInstanceLayerProperties(&count, layers);
+    for (uint32_t i = 0; i < count; i++) {
+        if (strcmp(layers[i].layerName, name) == 0)
+            return true;
+    }
+    return false;
+}
 
-    struct vk *vk = &window->vk;
-    vkCreateInstance(
-        &(VkInstanceCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-            .pApplicationInfo =
-                &(VkApplicationInfo){
-                    .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
-                    .pApplicationName = "window",
-                    .apiVersion = VK_MAKE_VERSION(1, 1, 0),
-                },
-            .enabledExtensionCount = 2,
-            .ppEnabledExtensionNames =
-                (const char *[]){
-                    VK_KHR_SURFACE_EXTENSION_NAME,
-                    VK_KHR_WAYLAND_SURFACE_EXTENSION_NAME,
-                },
-            .enabledLayerCount = 1,
-            .ppEnabledLayerNames =
-                (const char *[]){
-                    "VK_LAYER_KHRONOS_validation",
-                },
-        },
-        NULL, &vk->instance);
-
-    vkEnumeratePhysicalDevices(vk->instance, &count, NULL);
-    assert(count);
-    VkPhysicalDevice physical_devices[count];
-    vkEnumeratePhysicalDevices(vk->instance, &(uint32_t){1}, physical_devices);
-    vk->physical_device = physical_devices[0];
-
-    vkGetPhysicalDeviceMemoryProperties(vk->physical_device,
-                                        &vk->memory_properties);
-
-    vkGetPhysicalDeviceQueueFamilyProperties(vk->physical_device, &count, NULL);
-    assert(count);
-    VkQueueFamilyProperties props[count];
-    vkGetPhysicalDeviceQueueFamilyProperties(vk->physical_device, &count,
-                                             props);
-    assert(props[0].queueFlags & VK_QUEUE_GRAPHICS_BIT);
+static bool has_device_extension(VkPhysicalDevice physical_device,
+                                 const char *name) {
+    uint32_t count;
+    vkEnumerateDeviceExtensionProperties(physical_device, NULL, &count, NULL);
+    VkExtensionProperties extensions[count];
+    vkEnumerateDeviceExtensionProperties(physical_device, NULL, &count,
+                                         extensions);
+    for (uint32_t i = 0; i < count; i++) {
+        if (strcmp(extensions[i].extensionName, name) == 0)
+            return true;
+    }
+    return false;
+}
 
-    vkCreateDevice(
-        vk->physical_device,
-        &(VkDeviceCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-            .queueCreateInfoCount = 1,
-            .pQueueCreateInfos =
-                &(VkDeviceQueueCreateInfo){
-                    .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                    .queueFamilyIndex = 0,
-                    .queueCount = 1,
-                    .pQueuePriorities = (float[]){1.0f},
-                },
-            .enabledExtensionCount = 1,
-            .ppEnabledExtensionNames =
-                (const char *const[]){
-                    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-                },
-        },
-        NULL, &vk->device);
+static bool presentation_supported(struct display *display, uint32_t family) {
+    struct vk *vk = &display->vk;
 
-    vkGetDeviceQueue(vk->device, 0, 0, &vk->queue);
+    if (vk->headless)
+        return true;
 
     PFN_vkGetPhysicalDeviceWaylandPresentationSupportKHR
         get_wayland_presentation_support =
@@ -234,8 +387,52 @@ static void init_vulkan(struct window *window) {
                 vkGetInstanceProcAddr(
                     vk->instance,
                     "vkGetPhysicalDeviceWaylandPresentationSupportKHR");
-    assert(get_wayland_presentation_support(vk->physical_device, 0,
-                                            window->display->wl_display));
+    return get_wayland_presentation_support(vk->physical_device, family,
+                                            display->wl_display);
+}
+
+// Picks a graphics family that can present, and a transfer-only family for
+// uploads when the device has one. Transfer-only families usually map to
+// dedicated copy engines that run alongside rendering, compute-only ones
+// to async compute hardware.
+static void choose_queue_families(struct display *display,
+                                  const VkQueueFamilyProperties *props,
+                                  uint32_t count) {
+    struct vk *vk = &display->vk;
+
+    vk->queue_family = UINT32_MAX;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) &&
+            presentation_supported(display, i)) {
+            vk->queue_family = i;
+            break;
+        }
+    }
+    assert(vk->queue_family != UINT32_MAX);
+
+    vk->transfer_family = vk->queue_family;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((props[i].queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+            !(props[i].queueFlags &
+              (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            vk->transfer_family = i;
+            break;
+        }
+    }
+
+    vk->compute_family = vk->queue_family;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((props[i].queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+            !(props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            vk->compute_family = i;
+            break;
+        }
+    }
+}
+
+static void init_surface(struct window *window) {
+    uint32_t count;
+    struct vk *vk = &window->display->vk;
 
     PFN_vkCreateWaylandSurfaceKHR create_wayland_surface =
         (PFN_vkCreateWaylandSurfaceKHR)vkGetInstanceProcAddr(
@@ -248,118 +445,263 @@ static void init_vulkan(struct window *window) {
             .display = window->display->wl_display,
             .surface = window->wl_surface,
         },
-        NULL, &vk->surface);
+        NULL, &window->surface);
 
-    vkGetPhysicalDeviceSurfaceFormatsKHR(vk->physical_device, vk->surface,
+    vkGetPhysicalDeviceSurfaceFormatsKHR(vk->physical_device, window->surface,
                                          &count, NULL);
     VkSurfaceFormatKHR formats[count];
-    vkGetPhysicalDeviceSurfaceFormatsKHR(vk->physical_device, vk->surface,
+    vkGetPhysicalDeviceSurfaceFormatsKHR(vk->physical_device, window->surface,
                                          &count, formats);
+    bool supported = false;
     for (int i = 0; i < (int)count; i++) {
-        if (formats[i].format == VK_FORMAT_B8G8R8A8_UNORM) {
-            vk->image_format = formats[i].format;
+        if (formats[i].format == vk->image_format) {
+            supported = true;
             break;
         }
     }
-    assert(vk->image_format);
+    assert(supported);
+}
+
+// Every window renders in the same format, so that one render pass and one
+// set of pipelines serve them all.
+static void init_image_format(struct vk *vk) {
+    VkFormatProperties props;
+
+    vk->image_format = VK_FORMAT_B8G8R8A8_UNORM;
+    vkGetPhysicalDeviceFormatProperties(vk->physical_device, vk->image_format,
+                                        &props);
+    assert(props.optimalTilingFeatures &
+           VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT);
+}
+
+// Instance i of the grid as create_instances() lays it out.
+static struct instance grid_instance(const struct vk *vk, uint32_t i) {
+    uint32_t side = vk->grid_side, row = i / side, col = i % side;
+    float cell = vk->grid_cell;
+
+    return (struct instance){
+        .transform = {-1.0f + (col + 0.5f) * cell, -1.0f + (row + 0.5f) * cell,
+                      cell / 2, cell / 2},
+        .color = {255, 255 - 255 * row / side, 255 - 255 * col / side, 255},
+    };
+}
+
+// Lays the instances out on a square grid covering the viewport. A single
+// instance keeps the original full size, white triangle.
+static void create_instances(struct vk *vk) {
+    const uint32_t count = vk->instance_count;
+    const uint32_t per_chunk = UPLOAD_RING_SIZE / 4 / sizeof(struct instance);
+    uint32_t side = 1;
+
+    while ((uint64_t)side * side < count)
+        side++;
+    float cell = 2.0f / side;
+    vk->grid_side = side;
+    vk->grid_cell = cell;
+
+    vk->instance_buffer = create_buffer(
+        &vk->allocator, (VkDeviceSize)count * sizeof(struct instance),
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+
+    // generate straight into staging memory, chunk by chunk
+    for (uint32_t first = 0; first < count; first += per_chunk) {
+        uint32_t n = MIN(per_chunk, count - first);
+        struct instance *instances = upload_reserve(
+            &vk->uploader, vk->instance_buffer.buffer,
+            (VkDeviceSize)first * sizeof(struct instance),
+            (VkDeviceSize)n * sizeof(struct instance));
+        for (uint32_t i = 0; i < n; i++)
+            instances[i] = grid_instance(vk, first + i);
+        if (!vk->cull)
+            continue;
+
+        // the next reservation may flush the instances, and may even reuse
+        // their staging memory, so they are not read back from it
+        struct bounds *bounds =
+            upload_reserve(&vk->uploader, vk->culler.bounds.buffer,
+                           (VkDeviceSize)first * sizeof(*bounds),
+                           (VkDeviceSize)n * sizeof(*bounds));
+        for (uint32_t i = 0; i < n; i++) {
+            struct instance instance = grid_instance(vk, first + i);
+            // The triangle's farthest vertex is sqrt(0.5) from its origin.
+            // animate.comp moves the triangle by up to a quarter cell.
+            bounds[i] = (struct bounds){
+                .center = {instance.transform[0], instance.transform[1]},
+                .radius =
+                    0.7072f * cell / 2 + (vk->simulate ? cell / 4 : 0.0f),
+            };
+        }
+    }
+}
+
+// With preserve, the target image keeps what lies outside the render
+// area, for redrawing only the damaged part of it. Both passes are
+// compatible, so they share pipelines and framebuffers.
+static void create_render_pass(struct vk *vk, bool preserve,
+                               VkRenderPass *render_pass) {
+    bool msaa = vk->samples > 1;
+    VkImageLayout final_layout = vk->headless
+                                     ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                     : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    // Attachment 0 is the image we present or read back, with MSAA it is
+    // only written by the resolve. The multisampled color and the depth
+    // attachment are never stored.
+    VkAttachmentDescription descriptions[3] = {{
+        .format = vk->image_format,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .loadOp = msaa ? VK_ATTACHMENT_LOAD_OP_DONT_CARE
+                       : VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = preserve ? final_layout : VK_IMAGE_LAYOUT_UNDEFINED,
+        .finalLayout = final_layout,
+    }};
+    uint32_t attachment_count = 1;
+    VkAttachmentReference color_ref = {
+        .attachment = 0,
+        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+    VkAttachmentReference resolve_ref = {
+        .attachment = VK_ATTACHMENT_UNUSED,
+        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+    VkAttachmentReference depth_ref = {
+        .attachment = VK_ATTACHMENT_UNUSED,
+        .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    };
+    if (msaa) {
+        resolve_ref.attachment = 0;
+        color_ref.attachment = attachment_count;
+        descriptions[attachment_count++] = (VkAttachmentDescription){
+            .format = vk->image_format,
+            .samples = vk->samples,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        };
+    }
+    if (vk->depth) {
+        depth_ref.attachment = attachment_count;
+        descriptions[attachment_count++] = (VkAttachmentDescription){
+            .format = vk->depth_format,
+            .samples = vk->samples,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        };
+    }
 
     vkCreateRenderPass(
         vk->device,
         &(VkRenderPassCreateInfo){
             .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-            .attachmentCount = 1,
-            .pAttachments = (VkAttachmentDescription[]){{
-                .format = vk->image_format,
-                .samples = 1,
-                .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-                .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-                .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-                .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-            }},
+            .attachmentCount = attachment_count,
+            .pAttachments = descriptions,
             .subpassCount = 1,
             .pSubpasses = (VkSubpassDescription[]){{
                 .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
                 .colorAttachmentCount = 1,
-                .pColorAttachments =
-                    (VkAttachmentReference[]){
-                        {.attachment = 0,
-                         .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL}},
-                .pResolveAttachments =
-                    (VkAttachmentReference[]){
-                        {.attachment = VK_ATTACHMENT_UNUSED,
-                         .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL}},
-            }}},
-        NULL, &vk->render_pass);
-
-    vkCreateDescriptorSetLayout(
-        vk->device,
-        &(VkDescriptorSetLayoutCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-            .bindingCount = 1,
-            .pBindings = (VkDescriptorSetLayoutBinding[]){{
-                .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                .descriptorCount = 1,
-                .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-            }}},
-        NULL, &vk->desc_set_layout);
-
-    vkCreatePipelineLayout(
-        vk->device,
-        &(VkPipelineLayoutCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-            .setLayoutCount = 1,
-            .pSetLayouts = &vk->desc_set_layout,
+                .pColorAttachments = &color_ref,
+                .pResolveAttachments = &resolve_ref,
+                .pDepthStencilAttachment = &depth_ref,
+            }},
+            // All frames share the transient attachments, so a frame must
+            // not clear them while the previous one still draws. This also
+            // orders the layout transition after the acquire semaphore
+            // wait, which happens at color attachment output.
+            .dependencyCount = vk->capture_path ? 2 : 1,
+            .pDependencies =
+                (VkSubpassDependency[]){{
+                    .srcSubpass = VK_SUBPASS_EXTERNAL,
+                    .dstSubpass = 0,
+                    .srcStageMask =
+                        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                    .dstStageMask =
+                        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+                    .srcAccessMask =
+                        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                    .dstAccessMask =
+                        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                }, {
+                    // the capture copy reads the target after the pass
+                    .srcSubpass = 0,
+                    .dstSubpass = VK_SUBPASS_EXTERNAL,
+                    .srcStageMask =
+                        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                    .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                    .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+                }},
         },
-        NULL, &vk->pipeline_layout);
+        NULL, render_pass);
+}
 
+// Builds one variant. Only reads state that is set before the first call,
+// so the compile pool may run it for several variants at once; the
+// pipeline cache is internally synchronized.
+static void create_pipeline(struct vk *vk, uint32_t variant) {
     VkPipelineVertexInputStateCreateInfo vi_create_info = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        .vertexBindingDescriptionCount = 1,
-        .pVertexBindingDescriptions = (VkVertexInputBindingDescription[]){{
-            .binding = 0,
-            .stride = (3 + 3) * sizeof(float), // 3D + RGB
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
-        }},
-        .vertexAttributeDescriptionCount = 2,
+        .vertexBindingDescriptionCount = 2,
+        .pVertexBindingDescriptions =
+            (VkVertexInputBindingDescription[]){
+                {
+                    .binding = 0,
+                    .stride = VERTEX_STRIDE,
+                    .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+                },
+                {
+                    .binding = 1,
+                    .stride = sizeof(struct instance),
+                    .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+                },
+            },
+        .vertexAttributeDescriptionCount = 4,
         .pVertexAttributeDescriptions =
             (VkVertexInputAttributeDescription[]){
                 {
                     .location = 0,
                     .binding = 0,
-                    .format = VK_FORMAT_R32G32B32_SFLOAT,
+                    .format = vertex_formats[VERTEX_FORMAT].position,
                     .offset = 0,
                 },
                 {
                     .location = 1,
                     .binding = 0,
-                    .format = VK_FORMAT_R32G32B32_SFLOAT,
-                    .offset = 3 * sizeof(float),
+                    .format = vertex_formats[VERTEX_FORMAT].color,
+                    .offset = vertex_layouts[VERTEX_FORMAT].color_offset,
+                },
+                {
+                    .location = 2,
+                    .binding = 1,
+                    .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                    .offset = offsetof(struct instance, transform),
+                },
+                {
+                    .location = 3,
+                    .binding = 1,
+                    .format = VK_FORMAT_R8G8B8A8_UNORM,
+                    .offset = offsetof(struct instance, color),
                 },
             },
     };
 
-    VkShaderModule vs_module;
-    vkCreateShaderModule(
-        vk->device,
-        &(VkShaderModuleCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-            .codeSize = sizeof(vs_spirv_source),
-            .pCode = (uint32_t *)vs_spirv_source,
-        },
-        NULL, &vs_module);
-
-    VkShaderModule fs_module;
-    vkCreateShaderModule(
-        vk->device,
-        &(VkShaderModuleCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-            .codeSize = sizeof(fs_spirv_source),
-            .pCode = (uint32_t *)fs_spirv_source,
-        },
-        NULL, &fs_module);
-
     vkCreateGraphicsPipelines(
-        vk->device, (VkPipelineCache){VK_NULL_HANDLE}, 1,
+        vk->device, vk->pipeline_cache, 1,
         &(VkGraphicsPipelineCreateInfo){
             .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
             .stageCount = 2,
@@ -369,14 +711,25 @@ static void init_vulkan(struct window *window) {
                         .sType =
                             VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
                         .stage = VK_SHADER_STAGE_VERTEX_BIT,
-                        .module = vs_module,
+                        .module = vk->vs_module,
                         .pName = "main",
+                        .pSpecializationInfo =
+                            &(VkSpecializationInfo){
+                                .mapEntryCount = 1,
+                                .pMapEntries =
+                                    &(VkSpecializationMapEntry){
+                                        .constantID = 0,
+                                        .size = sizeof(int32_t),
+                                    },
+                                .dataSize = sizeof(int32_t),
+                                .pData = &pipeline_variants[variant].color_mode,
+                            },
                     },
                     {
                         .sType =
                             VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
                         .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-                        .module = fs_module,
+                        .module = vk->fs_module,
                         .pName = "main",
                     },
                 },
@@ -402,8 +755,8 @@ static void init_vulkan(struct window *window) {
                     .sType =
                         VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
                     .polygonMode = VK_POLYGON_MODE_FILL,
-                    .cullMode = VK_CULL_MODE_NONE,
-                    .frontFace = VK_FRONT_FACE_CLOCKWISE,
+                    .cullMode = pipeline_variants[variant].cull_mode,
+                    .frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
                     .depthBiasEnable = VK_FALSE,
                     .depthClampEnable = VK_FALSE,
                     .lineWidth = 1.0f,
@@ -413,12 +766,17 @@ static void init_vulkan(struct window *window) {
                 &(VkPipelineMultisampleStateCreateInfo){
                     .sType =
                         VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-                    .rasterizationSamples = 1,
+                    .rasterizationSamples = vk->samples,
                 },
+            // the fragment shader neither writes depth nor discards, so
+            // the test can run before shading
             .pDepthStencilState =
                 &(VkPipelineDepthStencilStateCreateInfo){
                     .sType =
                         VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+                    .depthTestEnable = vk->depth,
+                    .depthWriteEnable = vk->depth,
+                    .depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL,
                 },
 
             .pColorBlendState =
@@ -450,133 +808,811 @@ static void init_vulkan(struct window *window) {
             .renderPass = vk->render_pass,
             .subpass = 0,
         },
-        NULL, &vk->pipeline);
+        NULL, &vk->pipelines[variant]);
+}
 
-    // clang-format off
-	static const float vVertices[] = {
-        //  X      Y     Z      R      G      B
-		 0.0f, -0.5f,  0.0,  1.0f,  0.0f,  0.0f,
-		-0.5f,  0.5f,  0.0,  0.0f,  1.0f,  0.0f,
-		 0.5f,  0.5f,  0.0,  0.0f,  0.0f,  1.0f,
-	};
-    // clang-format on
+static void compile_job(void *data, uint32_t job) {
+    struct vk *vk = data;
+    // the variant drawn first was built before the batch started
+    uint32_t variant = job < vk->variant ? job : job + 1;
 
-    vk->vert_buffer =
-        create_buffer(vk, sizeof(vVertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                      true);
-    memcpy(vk->vert_buffer.map, vVertices, sizeof(vVertices));
-    vkUnmapMemory(vk->device, vk->vert_buffer.memory);
-    vk->vert_buffer.map = NULL;
-
-    vk->uniform_buffer =
-        create_buffer(vk, sizeof(float[16]), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                      true);
+    create_pipeline(vk, variant);
+    atomic_store_explicit(&vk->pipeline_ready[variant], true,
+                          memory_order_release);
+    if (atomic_fetch_sub(&vk->variants_left, 1) == 1)
+        vk->variants_done_ns = now_ns();
+}
 
-    vkCreateDescriptorPool(
-        vk->device,
-        &(VkDescriptorPoolCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-            .pNext = NULL,
-            .flags = 0,
-            .maxSets = 1,
-            .poolSizeCount = 1,
-            .pPoolSizes = (VkDescriptorPoolSize[]){{
-                .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                .descriptorCount = 1,
-            }},
-        },
-        NULL, &vk->desc_pool);
+// Cycles through the variants, skipping those still being compiled.
+static uint32_t next_ready_variant(struct vk *vk) {
+    for (uint32_t i = 1; i < NUM_PIPELINE_VARIANTS; i++) {
+        uint32_t variant = (vk->variant + i) % NUM_PIPELINE_VARIANTS;
+        if (atomic_load_explicit(&vk->pipeline_ready[variant],
+                                 memory_order_acquire))
+            return variant;
+    }
+    return vk->variant;
+}
 
-    vkAllocateDescriptorSets(
-        vk->device,
-        &(VkDescriptorSetAllocateInfo){
-            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-            .descriptorPool = vk->desc_pool,
-            .descriptorSetCount = 1,
-            .pSetLayouts = &vk->desc_set_layout,
-        },
-        &vk->desc_set);
+static void init_vulkan(struct display *display) {
+    uint32_t count;
 
-    vkUpdateDescriptorSets(
-        vk->device, 1,
-        (VkWriteDescriptorSet[]){{
-            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .dstSet = vk->desc_set,
-            .dstBinding = 0,
-            .dstArrayElement = 0,
-            .descriptorCount = 1,
-            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-            .pBufferInfo =
-                &(VkDescriptorBufferInfo){
-                    .buffer = vk->uniform_buffer.buffer,
-                    .offset = 0,
-                    .range = sizeof(float[16]),
-                },
-        }},
-        0, NULL);
+    struct vk *vk = &display->vk;
 
-    vkCreateCommandPool(
-        vk->device,
-        &(const VkCommandPoolCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-            .queueFamilyIndex = 0,
-            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+    // software drivers used on CI usually come without the validation layer
+    bool validation = has_instance_layer("VK_LAYER_KHRONOS_validation");
+    vkCreateInstance(
+        &(VkInstanceCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+            .pApplicationInfo =
+                &(VkApplicationInfo){
+                    .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+                    .pApplicationName = "window",
+                    .apiVersion = VK_MAKE_VERSION(1, 2, 0),
+                },
+            .enabledExtensionCount = vk->headless ? 0 : 2,
+            .ppEnabledExtensionNames =
+                (const char *[]){
+                    VK_KHR_SURFACE_EXTENSION_NAME,
+                    VK_KHR_WAYLAND_SURFACE_EXTENSION_NAME,
+                },
+            .enabledLayerCount = validation ? 1 : 0,
+            .ppEnabledLayerNames =
+                (const char *[]){
+                    "VK_LAYER_KHRONOS_validation",
+                },
         },
-        NULL, &vk->cmd_pool);
-}
-
-static void create_swapchain(struct window *window) {
-    struct vk *vk = &window->vk;
+        NULL, &vk->instance);
+    assert(vk->instance);
 
-    VkBool32 surface_supported;
-    vkGetPhysicalDeviceSurfaceSupportKHR(vk->physical_device, 0, vk->surface,
-                                         &surface_supported);
-    assert(surface_supported);
+    vkEnumeratePhysicalDevices(vk->instance, &count, NULL);
+    assert(count);
+    VkPhysicalDevice physical_devices[count];
+    vkEnumeratePhysicalDevices(vk->instance, &(uint32_t){1}, physical_devices);
+    vk->physical_device = physical_devices[0];
 
-    VkSurfaceCapabilitiesKHR surface_caps;
-    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vk->physical_device, vk->surface,
-                                              &surface_caps);
-    assert(surface_caps.supportedCompositeAlpha &
-           VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR);
-    assert(surface_caps.minImageCount >= 2 &&
-           surface_caps.minImageCount <= MAX_NUM_IMAGES);
+    // timeline semaphores are core in 1.2, and every 1.2 device has them
+    VkPhysicalDeviceProperties device_props;
+    vkGetPhysicalDeviceProperties(vk->physical_device, &device_props);
+    if (device_props.apiVersion < VK_MAKE_VERSION(1, 2, 0)) {
+        fprintf(stderr, "%s does not support Vulkan 1.2\n",
+                device_props.deviceName);
+        exit(EXIT_FAILURE);
+    }
+
+    vkGetPhysicalDeviceQueueFamilyProperties(vk->physical_device, &count, NULL);
+    assert(count);
+    VkQueueFamilyProperties props[count];
+    vkGetPhysicalDeviceQueueFamilyProperties(vk->physical_device, &count,
+                                             props);
+    choose_queue_families(display, props, count);
+
+    const char *extensions[3];
+    uint32_t extension_count = 0;
+    if (!vk->headless)
+        extensions[extension_count++] = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+    if (vk->cull) {
+        VkPhysicalDeviceFeatures features;
+        vkGetPhysicalDeviceFeatures(vk->physical_device, &features);
+        if (!features.multiDrawIndirect) {
+            fprintf(stderr, "no multiDrawIndirect, GPU culling disabled\n");
+            vk->cull = false;
+        } else if (!features.drawIndirectFirstInstance) {
+            // cull.comp selects the instance through firstInstance
+            fprintf(stderr,
+                    "no drawIndirectFirstInstance, GPU culling disabled\n");
+            vk->cull = false;
+        } else if (vk->instance_count >
+                   device_props.limits.maxDrawIndirectCount) {
+            // every instance is one draw of a single indirect call
+            fprintf(stderr, "more than %u instances, GPU culling disabled\n",
+                    device_props.limits.maxDrawIndirectCount);
+            vk->cull = false;
+        }
+    }
+    if (vk->track_damage && !vk->headless &&
+        has_device_extension(vk->physical_device,
+                             "VK_KHR_incremental_present")) {
+        extensions[extension_count++] = "VK_KHR_incremental_present";
+        vk->incremental_present = true;
+    }
+    if (vk->cull && has_device_extension(vk->physical_device,
+                                         "VK_KHR_draw_indirect_count")) {
+        extensions[extension_count++] = "VK_KHR_draw_indirect_count";
+        vk->draw_indirect_count = true;
+    }
+
+    // one queue from each distinct family
+    uint32_t families[] = {vk->queue_family, vk->transfer_family,
+                           vk->compute_family};
+    VkDeviceQueueCreateInfo queue_infos[ARRAY_LENGTH(families)];
+    uint32_t queue_info_count = 0;
+    for (uint32_t i = 0; i < ARRAY_LENGTH(families); i++) {
+        bool seen = false;
+        for (uint32_t j = 0; j < i; j++)
+            seen |= families[j] == families[i];
+        if (seen)
+            continue;
+        queue_infos[queue_info_count++] = (VkDeviceQueueCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = families[i],
+            .queueCount = 1,
+            .pQueuePriorities = (float[]){1.0f},
+        };
+    }
+
+    vkCreateDevice(
+        vk->physical_device,
+        &(VkDeviceCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+            .pNext =
+                &(VkPhysicalDeviceVulkan12Features){
+                    .sType =
+                        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+                    .timelineSemaphore = VK_TRUE,
+                },
+            .queueCreateInfoCount = queue_info_count,
+            .pQueueCreateInfos = queue_infos,
+            .enabledExtensionCount = extension_count,
+            .ppEnabledExtensionNames = extensions,
+            .pEnabledFeatures =
+                &(VkPhysicalDeviceFeatures){
+                    .multiDrawIndirect = vk->cull,
+                    .drawIndirectFirstInstance = vk->cull,
+                },
+        },
+        NULL, &vk->device);
+
+    vkGetDeviceQueue(vk->device, vk->queue_family, 0, &vk->queue);
+    vkGetDeviceQueue(vk->device, vk->transfer_family, 0, &vk->transfer_queue);
+    vkGetDeviceQueue(vk->device, vk->compute_family, 0, &vk->compute_queue);
+
+    allocator_init(&vk->allocator, vk->physical_device, vk->device);
+    sync_init(&vk->sync, vk->device, &vk->allocator);
+    uploader_init(&vk->uploader, &vk->allocator, &vk->sync, vk->transfer_queue,
+                  vk->transfer_family, vk->queue, vk->queue_family);
+
+    init_image_format(vk);
+    if (!vk->headless)
+        for (uint32_t i = 0; i < display->window_count; i++)
+            init_surface(&display->windows[i]);
+
+    if (vk->capture_path &&
+        !capture_init(&vk->capture, vk->physical_device, &vk->allocator,
+                      vk->sync.timeline, vk->image_format, vk->capture_path,
+                      vk->capture_format)) {
+        fprintf(stderr, "cannot open capture output %s\n", vk->capture_path);
+        exit(EXIT_FAILURE);
+    }
+
+    vk->samples = attachments_supported_samples(vk->physical_device,
+                                                vk->msaa, vk->depth);
+    if (vk->samples != vk->msaa)
+        fprintf(stderr, "%ux MSAA is not supported, using %ux\n", vk->msaa,
+                vk->samples);
+    // 16 bits are plenty for the scene's depth range and halve the memory
+    vk->depth_format = vk->depth ? VK_FORMAT_D16_UNORM : VK_FORMAT_UNDEFINED;
+
+    create_render_pass(vk, false, &vk->render_pass);
+    if (vk->track_damage)
+        create_render_pass(vk, true, &vk->partial_render_pass);
+
+    vkCreateDescriptorSetLayout(
+        vk->device,
+        &(VkDescriptorSetLayoutCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .bindingCount = 1,
+            .pBindings = (VkDescriptorSetLayoutBinding[]){{
+                .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                .descriptorCount = 1,
+                .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+            }}},
+        NULL, &vk->desc_set_layout);
+
+    vkCreatePipelineLayout(
+        vk->device,
+        &(VkPipelineLayoutCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount = 1,
+            .pSetLayouts = &vk->desc_set_layout,
+        },
+        NULL, &vk->pipeline_layout);
+
+    vkCreateShaderModule(
+        vk->device,
+        &(VkShaderModuleCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+            .codeSize = sizeof(vs_spirv_source),
+            .pCode = (uint32_t *)vs_spirv_source,
+        },
+        NULL, &vk->vs_module);
+
+    vkCreateShaderModule(
+        vk->device,
+        &(VkShaderModuleCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+            .codeSize = sizeof(fs_spirv_source),
+            .pCode = (uint32_t *)fs_spirv_source,
+        },
+        NULL, &vk->fs_module);
+
+    bool warm_cache;
+    vk->pipeline_cache =
+        pipeline_cache_load(vk->physical_device, vk->device, &warm_cache);
+
+    // The first frame only waits for the variant it draws with. The others
+    // compile in the background and become available as they finish.
+    vk->pipelines_start_ns = now_ns();
+    create_pipeline(vk, vk->variant);
+    atomic_store(&vk->pipeline_ready[vk->variant], true);
+    fprintf(stderr, "pipeline creation: %.3f ms (%s start)\n",
+            (now_ns() - vk->pipelines_start_ns) / 1e6,
+            warm_cache ? "warm" : "cold");
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    atomic_store(&vk->variants_left, NUM_PIPELINE_VARIANTS - 1);
+    thread_pool_init(&vk->compile_pool,
+                     MIN(NUM_PIPELINE_VARIANTS - 1, (uint32_t)MAX(cpus, 1)));
+    thread_pool_start(&vk->compile_pool, compile_job, vk,
+                      NUM_PIPELINE_VARIANTS - 1);
+
+    // Persistently mapped ring with a slice per frame. The CPU only writes
+    // the slice of a frame that has completed, and the descriptor set
+    // stays the same; each draw picks its slice with a dynamic offset.
+    vk->uniform_stride =
+        ALIGN_UP(sizeof(float[16]),
+                 device_props.limits.minUniformBufferOffsetAlignment);
+    vk->uniform_buffer = create_buffer(
+        &vk->allocator, NUM_UNIFORM_SLICES * vk->uniform_stride,
+        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    if (vk->cull)
+        culler_init(&vk->culler, vk->physical_device, vk->device,
+                    &vk->allocator, vk->pipeline_cache,
+                    vk->uniform_buffer.buffer, sizeof(float[16]),
+                    vk->instance_count, NUM_UNIFORM_SLICES,
+                    vk->draw_indirect_count);
+
+    // clang-format off
+	static const float vVertices[] = {
+        //  X      Y     Z      R      G      B
+		 0.0f, -0.5f,  0.0,  1.0f,  0.0f,  0.0f,
+		-0.5f,  0.5f,  0.0,  0.0f,  1.0f,  0.0f,
+		 0.5f,  0.5f,  0.0,  0.0f,  0.0f,  1.0f,
+	};
+    // clang-format on
+
+    // a mesh streams in from redraw(), chunk by chunk
+    if (vk->mesh_path) {
+        if (!mesh_open(&vk->mesh, vk->mesh_path))
+            exit(EXIT_FAILURE);
+        mesh_create_buffers(&vk->mesh, &vk->allocator);
+    } else {
+        // float32 is the widest layout
+        uint8_t packed[sizeof(vVertices)];
+        uint32_t count = ARRAY_LENGTH(vVertices) / 6;
+        for (uint32_t i = 0; i < count; i++)
+            pack_vertex(VERTEX_FORMAT, &vVertices[6 * i], &vVertices[6 * i + 3],
+                        packed + i * VERTEX_STRIDE);
+
+        vk->vert_buffer = create_buffer(&vk->allocator, count * VERTEX_STRIDE,
+                                        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                            VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                        0);
+        upload_buffer(&vk->uploader, vk->vert_buffer.buffer, 0, packed,
+                      count * VERTEX_STRIDE);
+    }
+    create_instances(vk);
+    upload_flush(&vk->uploader);
+
+    if (vk->simulate)
+        simulation_init(&vk->sim, vk->physical_device, vk->device,
+                        &vk->allocator, vk->pipeline_cache, vk->compute_queue,
+                        vk->compute_family, vk->queue_family,
+                        vk->instance_count, vk->grid_side, vk->grid_cell,
+                        vk->frame_count);
+    vk->start_ns = now_ns();
+
+    vkCreateDescriptorPool(
+        vk->device,
+        &(VkDescriptorPoolCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0,
+            .maxSets = 1,
+            .poolSizeCount = 1,
+            .pPoolSizes = (VkDescriptorPoolSize[]){{
+                .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                .descriptorCount = 1,
+            }},
+        },
+        NULL, &vk->desc_pool);
+
+    vkAllocateDescriptorSets(
+        vk->device,
+        &(VkDescriptorSetAllocateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = vk->desc_pool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &vk->desc_set_layout,
+        },
+        &vk->desc_set);
+
+    vkUpdateDescriptorSets(
+        vk->device, 1,
+        (VkWriteDescriptorSet[]){{
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = vk->desc_set,
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .pBufferInfo =
+                &(VkDescriptorBufferInfo){
+                    .buffer = vk->uniform_buffer.buffer,
+                    .offset = 0,
+                    .range = sizeof(float[16]),
+                },
+        }},
+        0, NULL);
+
+    vkCreateCommandPool(
+        vk->device,
+        &(const VkCommandPoolCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .queueFamilyIndex = vk->queue_family,
+            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        },
+        NULL, &vk->cmd_pool);
+
+    if (vk->record_threads)
+        thread_pool_init(&vk->record_pool, vk->record_threads);
+
+    uint32_t window_count = display->window_count;
+    for (uint32_t i = 0; i < vk->frame_count; i++) {
+        struct frame *frame = &vk->frames[i];
+
+        vkAllocateCommandBuffers(
+            vk->device,
+            &(VkCommandBufferAllocateInfo){
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .commandPool = vk->cmd_pool,
+                .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                .commandBufferCount = window_count,
+            },
+            frame->cmd_buffers);
+
+        for (uint32_t j = 0; j < vk->record_threads; j++) {
+            VkCommandBuffer job_cmd_buffers[window_count];
+
+            vkCreateCommandPool(
+                vk->device,
+                &(const VkCommandPoolCreateInfo){
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                    .queueFamilyIndex = vk->queue_family,
+                    .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+                },
+                NULL, &frame->job_pools[j]);
+            vkAllocateCommandBuffers(
+                vk->device,
+                &(VkCommandBufferAllocateInfo){
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                    .commandPool = frame->job_pools[j],
+                    .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+                    .commandBufferCount = window_count,
+                },
+                job_cmd_buffers);
+            for (uint32_t w = 0; w < window_count; w++)
+                frame->job_cmd_buffers[w][j] = job_cmd_buffers[w];
+        }
+
+        // offscreen images are neither acquired nor presented
+        if (vk->headless)
+            continue;
+
+        for (uint32_t w = 0; w < window_count; w++) {
+            vkCreateSemaphore(
+                vk->device,
+                &(VkSemaphoreCreateInfo){
+                    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                },
+                NULL, &frame->image_semaphores[w]);
+            vkCreateSemaphore(
+                vk->device,
+                &(VkSemaphoreCreateInfo){
+                    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                },
+                NULL, &frame->render_semaphores[w]);
+        }
+    }
+}
+
+static void create_offscreen_images(struct window *window) {
+    struct vk *vk = &window->display->vk;
+
+    // one image more than frames in flight so that rendering never has to
+    // wait for an image still owned by another frame
+    window->image_count = MAX(NUM_OFFSCREEN_IMAGES, vk->frame_count + 1);
+    assert(window->image_count <= MAX_NUM_IMAGES);
+    for (uint32_t i = 0; i < window->image_count; i++) {
+        struct window_buffer *win_buffer = &window->win_buffers[i];
+
+        vkCreateImage(vk->device,
+                      &(VkImageCreateInfo){
+                          .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                          .imageType = VK_IMAGE_TYPE_2D,
+                          .format = vk->image_format,
+                          .extent = {window->width, window->height, 1},
+                          .mipLevels = 1,
+                          .arrayLayers = 1,
+                          .samples = VK_SAMPLE_COUNT_1_BIT,
+                          .tiling = VK_IMAGE_TILING_OPTIMAL,
+                          .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                                   VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                          .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+                          .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                      },
+                      NULL, &win_buffer->image);
+
+        VkMemoryRequirements reqs;
+        vkGetImageMemoryRequirements(vk->device, win_buffer->image, &reqs);
+
+        bool ok = mem_alloc(&vk->allocator, &reqs, 0,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false,
+                            &win_buffer->alloc);
+        assert(ok);
+        vkBindImageMemory(vk->device, win_buffer->image,
+                          win_buffer->alloc.memory, win_buffer->alloc.offset);
+    }
+}
+
+// Timeline value of the last frame that rendered to any of the window's
+// images, after which they and everything attached to them are unused.
+static uint64_t window_last_use(const struct window *window) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < window->image_count; i++)
+        value = MAX(value, window->win_buffers[i].value);
+    return value;
+}
+
+static void create_swapchain_images(struct window *window) {
+    struct vk *vk = &window->display->vk;
+    VkSwapchainKHR old_swap_chain = window->swap_chain;
+
+    VkBool32 surface_supported;
+    vkGetPhysicalDeviceSurfaceSupportKHR(vk->physical_device, vk->queue_family,
+                                         window->surface, &surface_supported);
+    assert(surface_supported);
+
+    VkSurfaceCapabilitiesKHR surface_caps;
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vk->physical_device,
+                                              window->surface, &surface_caps);
+    assert(surface_caps.supportedCompositeAlpha &
+           VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR);
+
+    // Wayland leaves the extent to us, other platforms dictate it
+    if (surface_caps.currentExtent.width != UINT32_MAX) {
+        window->width = surface_caps.currentExtent.width;
+        window->height = surface_caps.currentExtent.height;
+    }
+    // the capture copies straight out of the swapchain images
+    VkImageUsageFlags image_usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    if (vk->capture_path)
+        image_usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    assert((surface_caps.supportedUsageFlags & image_usage) == image_usage);
+    assert(surface_caps.minImageCount >= 2 &&
+           surface_caps.minImageCount <= MAX_NUM_IMAGES);
+
+    const struct options *options = &window->display->options;
+    uint32_t image_count = MAX(options->swapchain_images,
+                               surface_caps.minImageCount);
+    if (surface_caps.maxImageCount)
+        image_count = MIN(image_count, surface_caps.maxImageCount);
+    image_count = MIN(image_count, MAX_NUM_IMAGES);
+
+    // FIFO is the only mode every surface has to support
+    uint32_t mode_count;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(
+        vk->physical_device, window->surface, &mode_count, NULL);
+    VkPresentModeKHR modes[mode_count];
+    vkGetPhysicalDeviceSurfacePresentModesKHR(
+        vk->physical_device, window->surface, &mode_count, modes);
+    window->present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    for (uint32_t i = 0; i < mode_count; i++)
+        if (modes[i] == options->present_mode)
+            window->present_mode = modes[i];
+    if (window->present_mode != options->present_mode)
+        fprintf(stderr, "present mode %s not supported, using fifo\n",
+                present_mode_name(options->present_mode));
 
     vkCreateSwapchainKHR(
         vk->device,
         &(VkSwapchainCreateInfoKHR){
             .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
             .flags = 0,
-            .surface = vk->surface,
-            .minImageCount = surface_caps.minImageCount,
+            .surface = window->surface,
+            .minImageCount = image_count,
             .imageFormat = vk->image_format,
             .imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR,
             .imageExtent = {window->width, window->height},
             .imageArrayLayers = 1,
-            .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+            .imageUsage = image_usage,
             .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
             .queueFamilyIndexCount = 1,
-            .pQueueFamilyIndices = (uint32_t[]){0},
+            .pQueueFamilyIndices = (uint32_t[]){vk->queue_family},
             .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
             .compositeAlpha = VK_COMPOSITE_ALPHA_PRE_MULTIPLIED_BIT_KHR,
-            .presentMode = VK_PRESENT_MODE_FIFO_KHR,
+            .presentMode = window->present_mode,
+            // lets the driver hand over resources of the old swapchain
+            .oldSwapchain = old_swap_chain,
         },
-        NULL, &vk->swap_chain);
+        NULL, &window->swap_chain);
+    // retired, its images may still be rendered to
+    if (old_swap_chain)
+        sync_retire_swapchain(&vk->sync, window_last_use(window),
+                              old_swap_chain);
+
+    vkGetSwapchainImagesKHR(vk->device, window->swap_chain,
+                            &window->image_count, NULL);
+    assert(window->image_count > 0 && window->image_count <= MAX_NUM_IMAGES);
+
+    VkImage swap_chain_images[window->image_count];
+    vkGetSwapchainImagesKHR(vk->device, window->swap_chain,
+                            &window->image_count, swap_chain_images);
+
+    for (uint32_t i = 0; i < window->image_count; i++)
+        window->win_buffers[i].image = swap_chain_images[i];
+}
 
-    vkGetSwapchainImagesKHR(vk->device, vk->swap_chain, &vk->image_count, NULL);
-    assert(vk->image_count > 0 && vk->image_count <= MAX_NUM_IMAGES);
+// Binds the scene and draws instances [first, first + count) into cmd,
+// which is either a primary inside the render pass or a secondary that
+// continues it. Only reads shared state, so jobs may call it in parallel.
+static void record_draws(struct window *window, VkCommandBuffer cmd,
+                         uint32_t slot, uint32_t first, uint32_t count) {
+    struct vk *vk = &window->display->vk;
+
+    VkBuffer vertices =
+        vk->mesh_path ? vk->mesh.vertices.buffer : vk->vert_buffer.buffer;
+    VkBuffer instances = vk->simulate ? simulation_buffer(&vk->sim)
+                                      : vk->instance_buffer.buffer;
+    vkCmdBindVertexBuffers(cmd, 0, 2, (VkBuffer[]){vertices, instances},
+                           (VkDeviceSize[]){0u, 0u});
+    if (vk->mesh_path)
+        vkCmdBindIndexBuffer(cmd, vk->mesh.indices.buffer, 0,
+                             mesh_index_type(&vk->mesh));
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      vk->pipelines[vk->variant]);
+
+    uint32_t uniform_offset = slot * vk->uniform_stride;
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            vk->pipeline_layout, 0, 1, &vk->desc_set, 1,
+                            &uniform_offset);
+
+    vkCmdSetViewport(cmd, 0, 1,
+                     &(VkViewport){
+                         .x = 0,
+                         .y = 0,
+                         .width = window->width,
+                         .height = window->height,
+                         .minDepth = 0,
+                         .maxDepth = 1,
+                     });
+    vkCmdSetScissor(cmd, 0, 1, &window->render_area);
+
+    if (vk->cull) {
+        cull_draw(&vk->culler, cmd, slot);
+    } else if (vk->mesh_path) {
+        // only the chunks flushed so far
+        uint32_t index_count = vk->mesh.ready_indices;
+        if (vk->separate_draws) {
+            for (uint32_t i = first; i < first + count; i++)
+                vkCmdDrawIndexed(cmd, index_count, 1, 0, 0, i);
+        } else {
+            vkCmdDrawIndexed(cmd, index_count, count, 0, 0, first);
+        }
+    } else if (vk->separate_draws) {
+        for (uint32_t i = first; i < first + count; i++)
+            vkCmdDraw(cmd, 3, 1, 0, i);
+    } else {
+        vkCmdDraw(cmd, 3, count, 0, first);
+    }
+}
 
-    VkImage swap_chain_images[vk->image_count];
-    vkGetSwapchainImagesKHR(vk->device, vk->swap_chain, &vk->image_count,
-                            swap_chain_images);
+struct record_job {
+    struct window *window;
+    struct frame *frame;
+    VkFramebuffer framebuffer;
+    uint32_t slot;
+};
 
-    for (uint32_t i = 0; i < vk->image_count; i++) {
-        struct window_buffer *win_buffer = &vk->win_buffers[i];
+// Records an even share of the instances into the job's secondary buffer
+// for the window. Each job owns its command pool, so no two threads ever
+// share one.
+static void record_job(void *data, uint32_t job) {
+    struct record_job *r = data;
+    struct vk *vk = &r->window->display->vk;
+    VkCommandBuffer cmd = r->frame->job_cmd_buffers[r->window->id][job];
+    uint32_t jobs = vk->record_threads;
+    uint32_t first = (uint64_t)vk->instance_count * job / jobs;
+    uint32_t end = (uint64_t)vk->instance_count * (job + 1) / jobs;
+
+    vkBeginCommandBuffer(
+        cmd,
+        &(VkCommandBufferBeginInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                     VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+            .pInheritanceInfo =
+                &(VkCommandBufferInheritanceInfo){
+                    .sType =
+                        VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+                    .renderPass = vk->render_pass,
+                    .subpass = 0,
+                    .framebuffer = r->framebuffer,
+                },
+        });
+    record_draws(r->window, cmd, r->slot, first, end - first);
+    vkEndCommandBuffer(cmd);
+}
+
+// Middle of the grid, like a blinking cursor in an otherwise idle panel.
+static uint32_t blink_instance(const struct vk *vk) {
+    return vk->instance_count / 2;
+}
+
+// Writes the blinking instance's new color. Earlier frames on the queue may
+// still read the old one, hence the barrier in front.
+static void record_blink(struct vk *vk, VkCommandBuffer cmd) {
+    struct instance instance = grid_instance(vk, blink_instance(vk));
+    if (vk->blink_on)
+        for (int c = 0; c < 3; c++)
+            instance.color[c] = 255 - instance.color[c];
+
+    VkBufferMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = vk->instance_buffer.buffer,
+        .offset = blink_instance(vk) * sizeof(struct instance) +
+                  offsetof(struct instance, color),
+        .size = sizeof(instance.color),
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 1,
+                         &barrier, 0, NULL);
+    vkCmdUpdateBuffer(cmd, barrier.buffer, barrier.offset, barrier.size,
+                      instance.color);
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, NULL, 1,
+                         &barrier, 0, NULL);
+}
+
+// Records the whole frame into cmd. slot selects the uniform slice and the
+// profiler queries the commands use. With record threads, the draws are
+// split across secondary buffers of frame slot, which is then the frame
+// index. frame_begin and frame_end mark the first and the last command
+// buffer of the frame's submit, which carry what is done once per frame.
+static void record_commands(struct window *window, VkCommandBuffer cmd,
+                            const struct window_buffer *win_buffer,
+                            uint32_t slot, bool frame_begin, bool frame_end) {
+    struct vk *vk = &window->display->vk;
+    VkFramebuffer framebuffer = win_buffer->framebuffer;
+
+    vkBeginCommandBuffer(
+        cmd,
+        &(VkCommandBufferBeginInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = 0,
+        });
+    if (frame_begin) {
+        if (vk->cull)
+            cull_record(&vk->culler, cmd, slot, slot * vk->uniform_stride);
+        if (vk->blink_update) {
+            record_blink(vk, cmd);
+            vk->blink_update = false;
+        }
+        // the timestamps bracket the render passes only, not the culling
+        // and updates before them or the capture copy after them
+        profiler_cmd_begin(&vk->profiler, cmd, slot);
+    }
+
+    vkCmdBeginRenderPass(
+        cmd,
+        &(VkRenderPassBeginInfo){
+            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+            .renderPass = window->partial_frame ? vk->partial_render_pass
+                                                : vk->render_pass,
+            .framebuffer = framebuffer,
+            .renderArea = window->render_area,
+            // one per attachment, unused ones are ignored
+            .clearValueCount = 3,
+            .pClearValues =
+                (VkClearValue[]){
+                    {.color = {.float32 = {0.0f, 0.0f, 0.0f, 0.5f}}},
+                    {.color = {.float32 = {0.0f, 0.0f, 0.0f, 0.5f}}},
+                    {.depthStencil = {.depth = 1.0f}},
+                },
+        },
+        vk->record_threads ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+                           : VK_SUBPASS_CONTENTS_INLINE);
+
+    if (vk->record_threads) {
+        struct frame *frame = &vk->frames[slot];
+        thread_pool_run(&vk->record_pool, record_job,
+                        &(struct record_job){
+                            .window = window,
+                            .frame = frame,
+                            .framebuffer = framebuffer,
+                            .slot = slot,
+                        },
+                        vk->record_threads);
+        vkCmdExecuteCommands(cmd, vk->record_threads,
+                             frame->job_cmd_buffers[window->id]);
+    } else {
+        record_draws(window, cmd, slot, 0, vk->instance_count);
+    }
+
+    vkCmdEndRenderPass(cmd);
+    if (frame_end)
+        profiler_cmd_end(&vk->profiler, cmd, slot);
+    if (vk->capture_path && window->id == 0)
+        capture_record(&vk->capture, cmd, win_buffer->image,
+                       vk->headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                    : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                       window->width, window->height);
+    vkEndCommandBuffer(cmd);
+}
+
+// Static scenes: every image gets a command buffer that is recorded once and
+// then resubmitted, using the image index as its slot. Call again whenever
+// the pipeline, the geometry or the extent change. Only for a single
+// window, whose command buffer is then the whole frame.
+static void record_cached_commands(struct window *window) {
+    struct vk *vk = &window->display->vk;
+
+    for (uint32_t i = 0; i < window->image_count; i++) {
+        struct window_buffer *win_buffer = &window->win_buffers[i];
+
+        if (!win_buffer->cmd_buffer)
+            vkAllocateCommandBuffers(
+                vk->device,
+                &(VkCommandBufferAllocateInfo){
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                    .commandPool = vk->cmd_pool,
+                    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                    .commandBufferCount = 1,
+                },
+                &win_buffer->cmd_buffer);
+        record_commands(window, win_buffer->cmd_buffer, win_buffer, i, true,
+                        true);
+    }
+    window->commands_valid = true;
+}
+
+static void create_swapchain(struct window *window) {
+    struct vk *vk = &window->display->vk;
+
+    window->swapchain_stale = false;
+    if (vk->headless)
+        create_offscreen_images(window);
+    else
+        create_swapchain_images(window);
+    window->attachments.samples = vk->samples;
+    window->attachments.depth_format = vk->depth_format;
+    attachments_create(&window->attachments, vk->device, &vk->allocator,
+                       vk->image_format, window->width, window->height);
+
+    for (uint32_t i = 0; i < window->image_count; i++) {
+        struct window_buffer *win_buffer = &window->win_buffers[i];
 
-        vk->win_buffers[i].image = swap_chain_images[i];
         vkCreateImageView(vk->device,
                           &(VkImageViewCreateInfo){
                               .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
@@ -601,192 +1637,1251 @@ static void create_swapchain(struct window *window) {
                           },
                           NULL, &win_buffer->view);
 
+        // in the order of the render pass attachments
+        VkImageView views[3] = {win_buffer->view};
+        uint32_t view_count = 1;
+        if (window->attachments.color)
+            views[view_count++] = window->attachments.color_view;
+        if (window->attachments.depth)
+            views[view_count++] = window->attachments.depth_view;
+
         vkCreateFramebuffer(
             vk->device,
             &(VkFramebufferCreateInfo){
                 .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
                 .renderPass = vk->render_pass,
-                .attachmentCount = 1,
-                .pAttachments = &win_buffer->view,
+                .attachmentCount = view_count,
+                .pAttachments = views,
                 .width = window->width,
                 .height = window->height,
                 .layers = 1,
             },
             NULL, &win_buffer->framebuffer);
 
-        vkCreateFence(vk->device,
-                      &(VkFenceCreateInfo){
-                          .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-                          .flags = VK_FENCE_CREATE_SIGNALED_BIT,
-                      },
-                      NULL, &win_buffer->cmd_fence);
+        win_buffer->value = 0;
+        // new images hold nothing yet
+        win_buffer->damage =
+            (struct rect){0, 0, window->width, window->height};
+    }
+    window->pending_damage =
+        (struct rect){0, 0, window->width, window->height};
+    window->render_area =
+        (VkRect2D){{0, 0}, {window->width, window->height}};
+    window->partial_frame = false;
+
+    if (vk->cached_commands)
+        record_cached_commands(window);
+}
 
-        vkAllocateCommandBuffers(
-            vk->device,
-            &(VkCommandBufferAllocateInfo){
-                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-                .commandPool = vk->cmd_pool,
-                .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-                .commandBufferCount = 1,
-            },
-            &win_buffer->cmd_buffer);
+// Rebuilds everything that depends on the extent. Nothing is waited for:
+// the old framebuffers, views and attachments are retired to the frame that
+// last used them, and destroyed once it completes.
+static void recreate_swapchain(struct window *window) {
+    struct vk *vk = &window->display->vk;
+    uint64_t last_use = window_last_use(window);
+
+    // except the cached command buffers, which are recorded again in place
+    if (vk->cached_commands)
+        sync_wait(&vk->sync, last_use);
+
+    for (uint32_t i = 0; i < window->image_count; i++) {
+        struct window_buffer *win_buffer = &window->win_buffers[i];
+
+        sync_retire_framebuffer(&vk->sync, last_use, win_buffer->framebuffer);
+        sync_retire_image(&vk->sync, last_use, VK_NULL_HANDLE,
+                          win_buffer->view, NULL);
     }
+    attachments_retire(&window->attachments, &vk->sync, last_use);
 
-    vkCreateSemaphore(vk->device,
-                      &(VkSemaphoreCreateInfo){
-                          .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-                      },
-                      NULL, &vk->image_semaphore);
-    vkCreateSemaphore(vk->device,
-                      &(VkSemaphoreCreateInfo){
-                          .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-                      },
-                      NULL, &vk->render_semaphore);
+    create_swapchain(window);
 }
 
-void redraw(struct window *window) {
-    VkResult r;
-    struct vk *vk = &window->vk;
-    uint32_t index;
-    r = vkAcquireNextImageKHR(vk->device, vk->swap_chain, UINT64_MAX,
-                              vk->image_semaphore, VK_NULL_HANDLE, &index);
-    assert(r == VK_SUCCESS);
+static void frame_callback_handle_done(void *data,
+                                       struct wl_callback *callback,
+                                       uint32_t time) {
+    struct window *window = data;
+    wl_callback_destroy(callback);
+    window->frame_callback = NULL;
+}
+static const struct wl_callback_listener frame_callback_listener = {
+    frame_callback_handle_done,
+};
 
-    struct window_buffer *win_buffer = &vk->win_buffers[index];
+// Pixels the instance covers, with a pixel of slack for rounding and MSAA.
+static struct rect instance_rect(const struct window *window, uint32_t i) {
+    const struct vk *vk = &window->display->vk;
+    struct instance instance = grid_instance(vk, i);
+    // vertices lie within half a unit of the origin, scaled by transform
+    float half_x = instance.transform[2] / 2, half_y = instance.transform[3] / 2;
+    float x0 = (instance.transform[0] - half_x) * vk->zoom;
+    float x1 = (instance.transform[0] + half_x) * vk->zoom;
+    float y0 = (instance.transform[1] - half_y) * vk->zoom;
+    float y1 = (instance.transform[1] + half_y) * vk->zoom;
+
+    return (struct rect){
+        floorf((x0 + 1) / 2 * window->width) - 1,
+        floorf((y0 + 1) / 2 * window->height) - 1,
+        ceilf((x1 + 1) / 2 * window->width) + 1,
+        ceilf((y1 + 1) / 2 * window->height) + 1,
+    };
+}
 
-    vkWaitForFences(vk->device, 1, &win_buffer->cmd_fence, VK_TRUE, UINT64_MAX);
-    vkResetFences(vk->device, 1, &win_buffer->cmd_fence);
+// Applies timed scene changes and adds what they damage to every window.
+// Anything animated damages the whole window.
+static void update_scene(struct display *display) {
+    struct vk *vk = &display->vk;
+    bool animated = vk->simulate || vk->cycle_frames ||
+                    (vk->mesh_path && !mesh_complete(&vk->mesh));
+    bool blink = false;
+
+    if (vk->blink_ms) {
+        uint64_t now = now_ns();
+        if (now >= vk->next_blink_ns) {
+            vk->next_blink_ns = now + vk->blink_ms * 1000000ull;
+            vk->blink_on = !vk->blink_on;
+            vk->blink_update = true;
+            blink = true;
+        }
+    }
 
-    vkBeginCommandBuffer(
-        win_buffer->cmd_buffer,
-        &(VkCommandBufferBeginInfo){
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-            .flags = 0,
-        });
+    for (uint32_t i = 0; i < display->window_count; i++) {
+        struct window *window = &display->windows[i];
+        struct rect full = {0, 0, window->width, window->height};
+
+        if (window->swapchain_stale || animated)
+            window->pending_damage = full;
+        if (blink)
+            window->pending_damage =
+                rect_union(window->pending_damage,
+                           rect_clamp(instance_rect(window, blink_instance(vk)),
+                                      window->width, window->height));
+    }
+}
 
-    vkCmdBeginRenderPass(
-        win_buffer->cmd_buffer,
-        &(VkRenderPassBeginInfo){
-            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-            .renderPass = vk->render_pass,
-            .framebuffer = win_buffer->framebuffer,
-            .renderArea = {{0, 0}, {window->width, window->height}},
-            .clearValueCount = 1,
-            .pClearValues =
-                (VkClearValue[]){
-                    {.color = {.float32 = {0.0f, 0.0f, 0.0f, 0.5f}}},
-                },
-        },
-        VK_SUBPASS_CONTENTS_INLINE);
+// Collects the windows the next frame draws: open ones the compositor is
+// ready for and, with damage tracking, that changed since their last frame.
+// Returns how many there are.
+static uint32_t ready_windows(struct display *display,
+                              struct window **windows) {
+    uint32_t count = 0;
 
-    vkCmdBindVertexBuffers(win_buffer->cmd_buffer, 0, 1,
-                           (VkBuffer[]){vk->vert_buffer.buffer},
-                           (VkDeviceSize[]){0u});
-    vkCmdBindPipeline(win_buffer->cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                      vk->pipeline);
+    for (uint32_t i = 0; i < display->window_count; i++) {
+        struct window *window = &display->windows[i];
+
+        if (window->closed || window->frame_callback)
+            continue;
+        if (display->vk.track_damage && rect_empty(window->pending_damage))
+            continue;
+        windows[count++] = window;
+    }
+    return count;
+}
+
+// Picks the render area for the acquired image: everything that changed
+// since it was last rendered, which with several images in rotation is
+// more than what changed since the last frame.
+static void damage_render_area(struct window *window,
+                               struct window_buffer *win_buffer) {
+    struct vk *vk = &window->display->vk;
+
+    for (uint32_t i = 0; i < window->image_count; i++)
+        window->win_buffers[i].damage =
+            rect_union(window->win_buffers[i].damage, window->pending_damage);
+
+    struct rect area = rect_clamp(win_buffer->damage, window->width,
+                                  window->height);
+    win_buffer->damage = (struct rect){0};
+    window->render_area = (VkRect2D){
+        {area.x0, area.y0},
+        {area.x1 - area.x0, area.y1 - area.y0},
+    };
+    window->partial_frame = area.x0 > 0 || area.y0 > 0 ||
+                            area.x1 < window->width ||
+                            area.y1 < window->height;
+    vk->frames_partial += window->partial_frame;
+    vk->pixels_rendered += (uint64_t)window->render_area.extent.width *
+                           window->render_area.extent.height;
+}
+
+// Renders a frame of each of the windows, which ready_windows() picked.
+// Their command buffers go to the queue in a single submit, and all their
+// images are presented at once.
+void redraw(struct display *display, struct window *const *windows,
+            uint32_t count) {
+    VkResult r;
+    struct vk *vk = &display->vk;
+    struct frame *frame = &vk->frames[vk->frame_index];
+    VkCommandBuffer cmd_buffers[count];
+    struct window_buffer *win_buffers[count];
+    uint32_t indices[count];
+    struct rect frame_damage[count];
+
+    profiler_begin_frame(&vk->profiler);
+
+    // wait until the GPU is done with the previous use of this frame slot
+    profiler_begin(&vk->profiler, PHASE_FENCE_WAIT);
+    sync_wait(&vk->sync, frame->value);
+    profiler_end(&vk->profiler, PHASE_FENCE_WAIT);
+    upload_collect(&vk->uploader);
+    sync_collect(&vk->sync);
+
+    if (vk->mesh_path && !mesh_complete(&vk->mesh))
+        mesh_stream(&vk->mesh, &vk->uploader, MESH_BYTES_PER_FRAME);
+
+    // submitted first so it runs while the previous frame rasterizes
+    if (vk->simulate)
+        simulation_step(&vk->sim, vk->frame_index,
+                        (now_ns() - vk->start_ns) / 1e9);
+
+    profiler_begin(&vk->profiler, PHASE_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++) {
+        struct window *window = windows[i];
+        uint32_t index;
+
+        if (vk->headless) {
+            index = window->next_image;
+            window->next_image = (index + 1) % window->image_count;
+        } else {
+            VkSemaphore semaphore = frame->image_semaphores[window->id];
+            if (window->swapchain_stale)
+                recreate_swapchain(window);
+            // nothing was signaled on OUT_OF_DATE, so the same semaphore can
+            // be used again. A suboptimal image is still rendered and
+            // presented.
+            while ((r = vkAcquireNextImageKHR(vk->device, window->swap_chain,
+                                              UINT64_MAX, semaphore,
+                                              VK_NULL_HANDLE, &index)) ==
+                   VK_ERROR_OUT_OF_DATE_KHR)
+                recreate_swapchain(window);
+            assert(r == VK_SUCCESS || r == VK_SUBOPTIMAL_KHR);
+            if (r == VK_SUBOPTIMAL_KHR)
+                window->swapchain_stale = true;
+        }
+        indices[i] = index;
+
+        struct window_buffer *win_buffer = &window->win_buffers[index];
+        win_buffers[i] = win_buffer;
+
+        // the image index need not match the frame slot, so the image may
+        // still be rendered to by another frame, exactly which is known
+        sync_wait(&vk->sync, win_buffer->value);
+
+        // what changed since the last frame, for the compositor
+        frame_damage[i] = window->pending_damage;
+        if (vk->track_damage) {
+            damage_render_area(window, win_buffer);
+            window->pending_damage = (struct rect){0};
+        } else {
+            window->render_area =
+                (VkRect2D){{0, 0}, {window->width, window->height}};
+        }
+    }
+    profiler_end(&vk->profiler, PHASE_ACQUIRE);
+
+    // cached command buffers belong to their image, so the uniform slice
+    // and the profiler queries follow the image instead of the frame
+    uint32_t slot = vk->cached_commands ? indices[0] : vk->frame_index;
+    profiler_collect(&vk->profiler, slot);
 
     // clang-format off
-    memcpy(vk->uniform_buffer.map,
+    memcpy((char *)vk->uniform_buffer.map + slot * vk->uniform_stride,
            (float[16]){
-            1,0,0,0,
-            0,1,0,0,
+            vk->zoom,0,0,0,
+            0,vk->zoom,0,0,
             0,0,1,0,
             0,0,0,1,
            },
            sizeof(float[16]));
     // clang-format on
-    vkCmdBindDescriptorSets(win_buffer->cmd_buffer,
-                            VK_PIPELINE_BIND_POINT_GRAPHICS,
-                            vk->pipeline_layout, 0, 1, &vk->desc_set, 0, NULL);
 
-    vkCmdSetViewport(win_buffer->cmd_buffer, 0, 1,
-                     &(VkViewport){
-                         .x = 0,
-                         .y = 0,
-                         .width = window->width,
-                         .height = window->height,
-                         .minDepth = 0,
-                         .maxDepth = 1,
-                     });
-    vkCmdSetScissor(win_buffer->cmd_buffer, 0, 1,
-                    &(VkRect2D){
-                        .offset = {0, 0},
-                        .extent = {window->width, window->height},
-                    });
-
-    vkCmdDraw(win_buffer->cmd_buffer, 3, 1, 0, 0);
-
-    vkCmdEndRenderPass(win_buffer->cmd_buffer);
-    vkEndCommandBuffer(win_buffer->cmd_buffer);
+    if (vk->cycle_frames && ++vk->frames_since_cycle == vk->cycle_frames) {
+        vk->frames_since_cycle = 0;
+        vk->variant = next_ready_variant(vk);
+    }
 
+    profiler_begin(&vk->profiler, PHASE_RECORD);
+    for (uint32_t j = 0; j < vk->record_threads; j++)
+        vkResetCommandPool(vk->device, frame->job_pools[j], 0);
+    for (uint32_t i = 0; i < count; i++) {
+        struct window *window = windows[i];
+
+        if (vk->cached_commands) {
+            if (!window->commands_valid)
+                record_cached_commands(window);
+            cmd_buffers[i] = win_buffers[i]->cmd_buffer;
+        } else {
+            cmd_buffers[i] = frame->cmd_buffers[window->id];
+            record_commands(window, cmd_buffers[i], win_buffers[i], slot,
+                            i == 0, i == count - 1);
+        }
+    }
+    profiler_end(&vk->profiler, PHASE_RECORD);
+
+    profiler_begin(&vk->profiler, PHASE_SUBMIT);
+    uint64_t submit_ns = presentation_now(&display->presentation);
+    // the render semaphores come first, they are what the present waits on
+    VkSemaphore wait_semaphores[count + 1], signal_semaphores[count + 2];
+    VkPipelineStageFlags wait_stages[count + 1];
+    uint32_t wait_count = 0, signal_count = 0;
+    if (!vk->headless) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t id = windows[i]->id;
+            wait_stages[wait_count] =
+                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+            wait_semaphores[wait_count++] = frame->image_semaphores[id];
+            signal_semaphores[signal_count++] = frame->render_semaphores[id];
+        }
+    }
+    if (vk->simulate) {
+        wait_stages[wait_count] = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+        wait_semaphores[wait_count++] = simulation_done(&vk->sim);
+        signal_semaphores[signal_count++] = simulation_free(&vk->sim);
+    }
+    // The timeline comes last. The other semaphores are binary, the WSI
+    // only takes those, and their values are ignored.
+    uint64_t signal_values[count + 2];
+    memset(signal_values, 0, sizeof(signal_values));
+    frame->value = sync_next_value(&vk->sync);
+    signal_values[signal_count] = frame->value;
+    signal_semaphores[signal_count++] = vk->sync.timeline;
+    for (uint32_t i = 0; i < count; i++)
+        win_buffers[i]->value = frame->value;
+    VkTimelineSemaphoreSubmitInfo timeline_info = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .pNext =
+            &(VkProtectedSubmitInfo){
+                .sType = VK_STRUCTURE_TYPE_PROTECTED_SUBMIT_INFO,
+            },
+        .signalSemaphoreValueCount = signal_count,
+        .pSignalSemaphoreValues = signal_values,
+    };
     vkQueueSubmit(vk->queue, 1,
                   &(VkSubmitInfo){
                       .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                      .pNext =
-                          &(VkProtectedSubmitInfo){
-                              .sType = VK_STRUCTURE_TYPE_PROTECTED_SUBMIT_INFO,
-                          },
-                      .waitSemaphoreCount = 1,
-                      .pWaitSemaphores = &vk->image_semaphore,
-                      .signalSemaphoreCount = 1,
-                      .pSignalSemaphores = &vk->render_semaphore,
-                      .pWaitDstStageMask =
-                          (VkPipelineStageFlags[]){
-                              VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                          },
-                      .commandBufferCount = 1,
-                      .pCommandBuffers = &win_buffer->cmd_buffer,
+                      .pNext = &timeline_info,
+                      .waitSemaphoreCount = wait_count,
+                      .pWaitSemaphores = wait_semaphores,
+                      .signalSemaphoreCount = signal_count,
+                      .pSignalSemaphores = signal_semaphores,
+                      .pWaitDstStageMask = wait_stages,
+                      .commandBufferCount = count,
+                      .pCommandBuffers = cmd_buffers,
                   },
-                  win_buffer->cmd_fence);
-
-    vkQueuePresentKHR(
-        vk->queue, &(VkPresentInfoKHR){
-                       .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-                       .waitSemaphoreCount = 1,
-                       .pWaitSemaphores = (VkSemaphore[]){vk->render_semaphore},
-                       .swapchainCount = 1,
-                       .pSwapchains = (VkSwapchainKHR[]){vk->swap_chain},
-                       .pImageIndices = (uint32_t[]){index},
-                       .pResults = &r,
-                   });
-    assert(r == VK_SUCCESS);
-
-    vkQueueWaitIdle(vk->queue);
-}
-
-int main() {
-    struct display display = {0};
-    struct window *window = &display.window;
-    window->display = &display;
-    window->width = 250;
-    window->height = 250;
-
-    display.wl_display = wl_display_connect(NULL);
-    assert(display.wl_display);
-
-    display.wl_registory = wl_display_get_registry(display.wl_display);
-    wl_registry_add_listener(display.wl_registory, &wl_registry_listener,
-                             &display);
-    wl_display_roundtrip(display.wl_display);
-    assert(display.xdg_wm_base && display.wl_compositor);
-
-    window->wl_surface = wl_compositor_create_surface(display.wl_compositor);
-    window->xdg_surface =
-        xdg_wm_base_get_xdg_surface(display.xdg_wm_base, window->wl_surface);
-    xdg_surface_add_listener(window->xdg_surface, &xdg_surface_listener,
-                             window);
-    window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
-    window->wait_for_configure = true;
-    wl_surface_commit(window->wl_surface);
-
-    while (window->wait_for_configure)
-        wl_display_dispatch(display.wl_display);
-
-    init_vulkan(window);
-    create_swapchain(window);
+                  VK_NULL_HANDLE);
+    if (vk->capture_path)
+        capture_submit(&vk->capture, frame->value);
+    profiler_end(&vk->profiler, PHASE_SUBMIT);
+
+    if (!vk->headless) {
+        profiler_begin(&vk->profiler, PHASE_PRESENT);
+        VkSwapchainKHR swap_chains[count];
+        VkRectLayerKHR rects[count];
+        VkPresentRegionKHR present_regions[count];
+        VkResult results[count];
+        for (uint32_t i = 0; i < count; i++) {
+            struct window *window = windows[i];
+
+            // both requests apply to the commit done by vkQueuePresentKHR
+            window->frame_callback = wl_surface_frame(window->wl_surface);
+            wl_callback_add_listener(window->frame_callback,
+                                     &frame_callback_listener, window);
+            swap_chains[i] = window->swap_chain;
+            // The WSI commits the surface, so the damage can only reach the
+            // compositor through the present, full damage otherwise.
+            struct rect damage =
+                rect_clamp(frame_damage[i], window->width, window->height);
+            rects[i] = (VkRectLayerKHR){
+                .offset = {damage.x0, damage.y0},
+                .extent = {damage.x1 - damage.x0, damage.y1 - damage.y0},
+            };
+            present_regions[i] = (VkPresentRegionKHR){
+                .rectangleCount = 1,
+                .pRectangles = &rects[i],
+            };
+        }
+        // latency and pacing follow the first window of the batch
+        presentation_feedback(
+            &display->presentation, windows[0]->wl_surface, submit_ns,
+            display->pacer.target_ns,
+            display->frames_done >= display->options.warmup_frames);
+        VkPresentRegionsKHR regions = {
+            .sType = VK_STRUCTURE_TYPE_PRESENT_REGIONS_KHR,
+            .swapchainCount = count,
+            .pRegions = present_regions,
+        };
+        vkQueuePresentKHR(
+            vk->queue,
+            &(VkPresentInfoKHR){
+                .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+                .pNext = vk->incremental_present ? &regions : NULL,
+                .waitSemaphoreCount = count,
+                .pWaitSemaphores = signal_semaphores,
+                .swapchainCount = count,
+                .pSwapchains = swap_chains,
+                .pImageIndices = indices,
+                .pResults = results,
+            });
+        for (uint32_t i = 0; i < count; i++) {
+            struct window *window = windows[i];
+
+            r = results[i];
+            if (r == VK_ERROR_OUT_OF_DATE_KHR) {
+                // nothing was committed, so no frame callback will come
+                wl_callback_destroy(window->frame_callback);
+                window->frame_callback = NULL;
+            }
+            assert(r == VK_SUCCESS || r == VK_SUBOPTIMAL_KHR ||
+                   r == VK_ERROR_OUT_OF_DATE_KHR);
+            if (r != VK_SUCCESS)
+                window->swapchain_stale = true;
+        }
+        profiler_end(&vk->profiler, PHASE_PRESENT);
+    }
+
+    profiler_end_frame(&vk->profiler, slot);
+    vk->frame_index = (vk->frame_index + 1) % vk->frame_count;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --headless       render offscreen without a Wayland compositor\n"
+            "  --windows N      open N windows, 1 to %d, that share the\n"
+            "                   device and are drawn with one submit and\n"
+            "                   presented together (default: 1)\n"
+            "  --frames N       stop after N frames (headless default: %d)\n"
+            "  --frames-in-flight N\n"
+            "                   number of frames the CPU may record ahead of\n"
+            "                   the GPU, 1 to %d (default: %d)\n"
+            "  --width N        width of the rendered image\n"
+            "  --height N       height of the rendered image\n"
+            "  --trace FILE     write per-frame CPU and GPU timings to FILE,\n"
+            "                   as Chrome trace JSON if FILE ends in .json\n"
+            "                   and as CSV otherwise; SIGUSR1 flushes it\n"
+            "  --stats FILE     write frame time statistics as JSON to FILE,\n"
+            "                   - for stdout\n"
+            "  --warmup N       leave the first N frames out of the statistics\n"
+            "  --instances N    draw N triangles on a grid, 1 to %u\n"
+            "  --separate-draws issue one draw call per triangle instead of\n"
+            "                   a single instanced draw\n"
+            "  --cached-commands\n"
+            "                   record each image's command buffer once and\n"
+            "                   resubmit it every frame\n"
+            "  --present-mode MODE\n"
+            "                   fifo, fifo-relaxed, mailbox or immediate,\n"
+            "                   falling back to fifo (default: fifo)\n"
+            "  --swapchain-images N\n"
+            "                   request at least N swapchain images\n"
+            "  --fps N          headless frame rate (default: unpaced)\n"
+            "  --pacing         start each frame as late as possible while\n"
+            "                   still making the next vblank\n"
+            "  --threads N      record draws on N worker threads into\n"
+            "                   secondary command buffers, up to %d\n"
+            "  --cull           cull on the GPU and draw with indirect draws\n"
+            "  --zoom Z         scale the view by Z, values above 1 move\n"
+            "                   part of the grid off screen (default: 1)\n"
+            "  --simulate       animate the instances with a compute shader\n"
+            "                   on an async compute queue if there is one\n"
+            "  --mesh FILE      draw the .mesh FILE on every instance instead\n"
+            "                   of a triangle, see tools/meshconv\n"
+            "  --variant NAME   pipeline variant to draw with: modulate,\n"
+            "                   vertex or tint coloring, each optionally\n"
+            "                   with -cull-back (default: modulate)\n"
+            "  --cycle-variants N\n"
+            "                   switch to the next compiled variant every\n"
+            "                   N frames\n"
+            "  --msaa N         render with N samples per pixel, 1, 2, 4 or 8,\n"
+            "                   resolved in the render pass (default: 1)\n"
+            "  --depth          add a depth buffer\n"
+            "  --damage         only draw and present what changed since the\n"
+            "                   last frame, nothing for an unchanged scene\n"
+            "  --blink MS       with --damage, flip the color of one\n"
+            "                   triangle every MS milliseconds\n"
+            "  --capture FILE   write every rendered frame of the first\n"
+            "                   window to FILE, or pipe them to a command\n"
+            "                   given as '|COMMAND'; frames are dropped\n"
+            "                   rather than waited for when the output\n"
+            "                   cannot keep up\n"
+            "  --capture-format FORMAT\n"
+            "                   ppm or raw, raw being the image's BGRA bytes\n"
+            "                   without a header (default: ppm)\n",
+            prog, MAX_WINDOWS, DEFAULT_HEADLESS_FRAMES, MAX_FRAMES_IN_FLIGHT,
+            DEFAULT_FRAMES_IN_FLIGHT, MAX_INSTANCES, MAX_RECORD_THREADS);
+}
+
+static void parse_options(struct options *options, int argc, char *argv[]) {
+    enum {
+        OPT_HEADLESS = 256,
+        OPT_WINDOWS,
+        OPT_FRAMES,
+        OPT_FRAMES_IN_FLIGHT,
+        OPT_WIDTH,
+        OPT_HEIGHT,
+        OPT_TRACE,
+        OPT_STATS,
+        OPT_WARMUP,
+        OPT_INSTANCES,
+        OPT_SEPARATE_DRAWS,
+        OPT_CACHED_COMMANDS,
+        OPT_PRESENT_MODE,
+        OPT_SWAPCHAIN_IMAGES,
+        OPT_FPS,
+        OPT_PACING,
+        OPT_THREADS,
+        OPT_CULL,
+        OPT_ZOOM,
+        OPT_SIMULATE,
+        OPT_MESH,
+        OPT_VARIANT,
+        OPT_CYCLE_VARIANTS,
+        OPT_MSAA,
+        OPT_DEPTH,
+        OPT_DAMAGE,
+        OPT_BLINK,
+        OPT_CAPTURE,
+        OPT_CAPTURE_FORMAT,
+    };
+    static const struct option long_options[] = {
+        {"headless", no_argument, NULL, OPT_HEADLESS},
+        {"windows", required_argument, NULL, OPT_WINDOWS},
+        {"frames", required_argument, NULL, OPT_FRAMES},
+        {"frames-in-flight", required_argument, NULL, OPT_FRAMES_IN_FLIGHT},
+        {"width", required_argument, NULL, OPT_WIDTH},
+        {"height", required_argument, NULL, OPT_HEIGHT},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {"stats", required_argument, NULL, OPT_STATS},
+        {"warmup", required_argument, NULL, OPT_WARMUP},
+        {"instances", required_argument, NULL, OPT_INSTANCES},
+        {"separate-draws", no_argument, NULL, OPT_SEPARATE_DRAWS},
+        {"cached-commands", no_argument, NULL, OPT_CACHED_COMMANDS},
+        {"present-mode", required_argument, NULL, OPT_PRESENT_MODE},
+        {"swapchain-images", required_argument, NULL, OPT_SWAPCHAIN_IMAGES},
+        {"fps", required_argument, NULL, OPT_FPS},
+        {"pacing", no_argument, NULL, OPT_PACING},
+        {"threads", required_argument, NULL, OPT_THREADS},
+        {"cull", no_argument, NULL, OPT_CULL},
+        {"zoom", required_argument, NULL, OPT_ZOOM},
+        {"simulate", no_argument, NULL, OPT_SIMULATE},
+        {"mesh", required_argument, NULL, OPT_MESH},
+        {"variant", required_argument, NULL, OPT_VARIANT},
+        {"cycle-variants", required_argument, NULL, OPT_CYCLE_VARIANTS},
+        {"msaa", required_argument, NULL, OPT_MSAA},
+        {"depth", no_argument, NULL, OPT_DEPTH},
+        {"damage", no_argument, NULL, OPT_DAMAGE},
+        {"blink", required_argument, NULL, OPT_BLINK},
+        {"capture", required_argument, NULL, OPT_CAPTURE},
+        {"capture-format", required_argument, NULL, OPT_CAPTURE_FORMAT},
+        {"help", no_argument, NULL, 'h'},
+        {0},
+    };
 
-    while (wl_display_dispatch_pending(display.wl_display) != -1)
-        redraw(window);
+    *options = (struct options){
+        .frames_in_flight = DEFAULT_FRAMES_IN_FLIGHT,
+        .width = 250,
+        .height = 250,
+        .instances = 1,
+        .present_mode = VK_PRESENT_MODE_FIFO_KHR,
+        .zoom = 1.0f,
+        .msaa = 1,
+        .windows = 1,
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+        case OPT_HEADLESS:
+            options->headless = true;
+            break;
+        case OPT_WINDOWS:
+            options->windows = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_FRAMES:
+            options->frames = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_FRAMES_IN_FLIGHT:
+            options->frames_in_flight = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_WIDTH:
+            options->width = atoi(optarg);
+            break;
+        case OPT_HEIGHT:
+            options->height = atoi(optarg);
+            break;
+        case OPT_TRACE:
+            options->trace_path = optarg;
+            break;
+        case OPT_STATS:
+            options->stats_path = optarg;
+            break;
+        case OPT_WARMUP:
+            options->warmup_frames = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_INSTANCES:
+            options->instances = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_SEPARATE_DRAWS:
+            options->separate_draws = true;
+            break;
+        case OPT_CACHED_COMMANDS:
+            options->cached_commands = true;
+            break;
+        case OPT_PRESENT_MODE: {
+            size_t i;
+            for (i = 0; i < ARRAY_LENGTH(present_modes); i++)
+                if (strcmp(optarg, present_modes[i].name) == 0)
+                    break;
+            if (i == ARRAY_LENGTH(present_modes)) {
+                fprintf(stderr, "unknown present mode %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            options->present_mode = present_modes[i].mode;
+            break;
+        }
+        case OPT_SWAPCHAIN_IMAGES:
+            options->swapchain_images = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_FPS:
+            options->fps = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_PACING:
+            options->pacing = true;
+            break;
+        case OPT_THREADS:
+            options->threads = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_CULL:
+            options->cull = true;
+            break;
+        case OPT_ZOOM:
+            options->zoom = strtod(optarg, NULL);
+            break;
+        case OPT_SIMULATE:
+            options->simulate = true;
+            break;
+        case OPT_MESH:
+            options->mesh_path = optarg;
+            break;
+        case OPT_VARIANT:
+            options->variant = NUM_PIPELINE_VARIANTS;
+            for (uint32_t i = 0; i < NUM_PIPELINE_VARIANTS; i++)
+                if (strcmp(optarg, pipeline_variants[i].name) == 0)
+                    options->variant = i;
+            if (options->variant == NUM_PIPELINE_VARIANTS) {
+                fprintf(stderr, "unknown pipeline variant '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_CYCLE_VARIANTS:
+            options->cycle_variants = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_MSAA:
+            options->msaa = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_DEPTH:
+            options->depth = true;
+            break;
+        case OPT_DAMAGE:
+            options->damage = true;
+            break;
+        case OPT_BLINK:
+            options->blink_ms = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_CAPTURE:
+            options->capture_path = optarg;
+            break;
+        case OPT_CAPTURE_FORMAT:
+            if (strcmp(optarg, "ppm") == 0) {
+                options->capture_format = CAPTURE_PPM;
+            } else if (strcmp(optarg, "raw") == 0) {
+                options->capture_format = CAPTURE_RAW;
+            } else {
+                fprintf(stderr, "unknown capture format '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options->width <= 0 || options->height <= 0) {
+        fprintf(stderr, "invalid size %dx%d\n", options->width,
+                options->height);
+        exit(EXIT_FAILURE);
+    }
+    if (options->windows < 1 || options->windows > MAX_WINDOWS) {
+        fprintf(stderr, "windows must be between 1 and %d\n", MAX_WINDOWS);
+        exit(EXIT_FAILURE);
+    }
+    if (options->windows > 1 && options->cached_commands) {
+        fprintf(stderr, "--windows records a frame's command buffers "
+                        "together, it excludes --cached-commands\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->frames_in_flight < 1 ||
+        options->frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+        fprintf(stderr, "frames in flight must be between 1 and %d\n",
+                MAX_FRAMES_IN_FLIGHT);
+        exit(EXIT_FAILURE);
+    }
+    if (options->instances < 1 || options->instances > MAX_INSTANCES) {
+        fprintf(stderr, "instances must be between 1 and %u\n",
+                MAX_INSTANCES);
+        exit(EXIT_FAILURE);
+    }
+    if (options->swapchain_images > MAX_NUM_IMAGES) {
+        fprintf(stderr, "at most %d swapchain images are supported\n",
+                MAX_NUM_IMAGES);
+        exit(EXIT_FAILURE);
+    }
+    if (options->threads > MAX_RECORD_THREADS) {
+        fprintf(stderr, "at most %d record threads are supported\n",
+                MAX_RECORD_THREADS);
+        exit(EXIT_FAILURE);
+    }
+    if (options->threads && options->cached_commands) {
+        fprintf(stderr, "--threads and --cached-commands are exclusive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->cull && (options->threads || options->separate_draws)) {
+        fprintf(stderr,
+                "--cull already draws each object on its own, it excludes "
+                "--threads and --separate-draws\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->simulate && options->cached_commands) {
+        fprintf(stderr, "--simulate changes the instance buffer every "
+                        "frame, it excludes --cached-commands\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->mesh_path && (options->cull || options->cached_commands)) {
+        fprintf(stderr, "--mesh draws a growing index range, it excludes "
+                        "--cull and --cached-commands\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->cycle_variants && options->cached_commands) {
+        fprintf(stderr, "--cycle-variants changes the bound pipeline, it "
+                        "excludes --cached-commands\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->msaa != 1 && options->msaa != 2 && options->msaa != 4 &&
+        options->msaa != 8) {
+        fprintf(stderr, "MSAA sample count must be 1, 2, 4 or 8\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->damage && options->cached_commands) {
+        fprintf(stderr, "--damage records a different render area each "
+                        "frame, it excludes --cached-commands\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->blink_ms && (!options->damage || options->simulate)) {
+        fprintf(stderr, "--blink needs --damage and a static scene, it "
+                        "excludes --simulate\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->capture_path && options->cached_commands) {
+        fprintf(stderr, "--capture copies into a different buffer each "
+                        "frame, it excludes --cached-commands\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!(options->zoom > 0)) {
+        fprintf(stderr, "zoom must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->headless && !options->frames)
+        options->frames = DEFAULT_HEADLESS_FRAMES;
+}
+
+static void frame_done(struct display *display, uint32_t frame) {
+    uint64_t now = now_ns();
+    if (frame >= display->options.warmup_frames)
+        series_add(&display->frame_times, now - display->last_frame_ns);
+    display->last_frame_ns = now;
+    display->frames_done = frame + 1;
+    if (frame == 0)
+        display->first_frame_ns = now - display->start_ns;
+}
+
+static void write_memory_stats(FILE *f, const struct allocator *allocator) {
+    bool first = true;
+
+    fprintf(f, "  \"memory\": {\n");
+    fprintf(f, "    \"device_allocations\": %u,\n",
+            allocator->device_allocations);
+    fprintf(f, "    \"types\": [");
+    for (uint32_t i = 0; i < allocator->props.memoryTypeCount; i++) {
+        struct memory_type_stats stats;
+        allocator_type_stats(allocator, i, &stats);
+        if (!stats.blocks)
+            continue;
+
+        // share of free memory that is not part of the largest free range
+        VkDeviceSize free = stats.reserved - stats.used;
+        double fragmentation =
+            free ? 1.0 - (double)stats.largest_free / free : 0.0;
+
+        fprintf(f, "%s\n      {", first ? "" : ",");
+        fprintf(f, "\"type\": %u, ", i);
+        fprintf(f, "\"flags\": %u, ",
+                allocator->props.memoryTypes[i].propertyFlags);
+        fprintf(f, "\"blocks\": %u, ", stats.blocks);
+        fprintf(f, "\"allocations\": %u, ", stats.allocations);
+        fprintf(f, "\"reserved_bytes\": %" PRIu64 ", ",
+                (uint64_t)stats.reserved);
+        fprintf(f, "\"used_bytes\": %" PRIu64 ", ", (uint64_t)stats.used);
+        fprintf(f, "\"fragmentation\": %.4f}", fragmentation);
+        first = false;
+    }
+    fprintf(f, "\n    ]\n");
+    fprintf(f, "  }\n");
+}
+
+// Keys are always written in the same order and with fixed precision so that
+// results of different commits can be diffed.
+static void write_summary(FILE *f, const char *name,
+                          const struct summary *summary) {
+    fprintf(f, "  \"%s\": {\n", name);
+    fprintf(f, "    \"mean\": %.4f,\n", summary->mean);
+    fprintf(f, "    \"p50\": %.4f,\n", summary->p50);
+    fprintf(f, "    \"p95\": %.4f,\n", summary->p95);
+    fprintf(f, "    \"p99\": %.4f,\n", summary->p99);
+    fprintf(f, "    \"max\": %.4f\n", summary->max);
+    fprintf(f, "  },\n");
+}
+
+static void write_stats(struct display *display) {
+    const struct options *options = &display->options;
+    struct vk *vk = &display->vk;
+    const struct window *window = &display->windows[0];
+    struct summary frame_time, latency, deadline_error;
+    VkPhysicalDeviceProperties props;
+    FILE *f = stdout;
+
+    if (strcmp(options->stats_path, "-") != 0) {
+        f = fopen(options->stats_path, "w");
+        if (!f) {
+            perror(options->stats_path);
+            return;
+        }
+    }
+
+    vkGetPhysicalDeviceProperties(vk->physical_device, &props);
+    series_summarize(&display->frame_times, &frame_time);
+    series_summarize(&display->presentation.latency, &latency);
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"device\": \"%s\",\n", props.deviceName);
+    fprintf(f, "  \"headless\": %s,\n", options->headless ? "true" : "false");
+    fprintf(f, "  \"width\": %d,\n", options->width);
+    fprintf(f, "  \"height\": %d,\n", options->height);
+    fprintf(f, "  \"windows\": %u,\n", display->window_count);
+    fprintf(f, "  \"frames_in_flight\": %u,\n", options->frames_in_flight);
+    fprintf(f, "  \"instances\": %u,\n", options->instances);
+    fprintf(f, "  \"draws_per_frame\": %u,\n",
+            options->separate_draws ? options->instances : 1);
+    fprintf(f, "  \"cached_commands\": %s,\n",
+            options->cached_commands ? "true" : "false");
+    fprintf(f, "  \"record_threads\": %u,\n", options->threads);
+    fprintf(f, "  \"gpu_culling\": %s,\n", vk->cull ? "true" : "false");
+    fprintf(f, "  \"zoom\": %.3f,\n", options->zoom);
+    fprintf(f, "  \"simulation\": %s,\n",
+            options->simulate ? "true" : "false");
+    fprintf(f, "  \"async_compute\": %s,\n",
+            vk->compute_family != vk->queue_family ? "true" : "false");
+    fprintf(f, "  \"vertex_format\": \"%s\",\n", VERTEX_FORMAT_NAME);
+    fprintf(f, "  \"pipeline_variants\": %zu,\n", NUM_PIPELINE_VARIANTS);
+    fprintf(f, "  \"pipeline_variant\": \"%s\",\n",
+            pipeline_variants[options->variant].name);
+    // process start to the end of the first frame, and first pipeline to
+    // the last variant
+    fprintf(f, "  \"first_frame_ms\": %.3f,\n",
+            display->first_frame_ns / 1e6);
+    fprintf(f, "  \"all_variants_ms\": %.3f,\n",
+            (vk->variants_done_ns - vk->pipelines_start_ns) / 1e6);
+    fprintf(f, "  \"vertex_stride\": %u,\n", VERTEX_STRIDE);
+    if (vk->mesh_path) {
+        // time from opening the file until the first and last chunk were
+        // queued for the GPU
+        fprintf(f, "  \"mesh_indices\": %u,\n", vk->mesh.ready_indices);
+        fprintf(f, "  \"mesh_first_chunk_ms\": %.3f,\n",
+                vk->mesh.first_chunk_ns / 1e6);
+        fprintf(f, "  \"mesh_load_ms\": %.3f,\n",
+                vk->mesh.complete_ns / 1e6);
+    }
+    if (!options->headless) {
+        fprintf(f, "  \"present_mode\": \"%s\",\n",
+                present_mode_name(window->present_mode));
+        fprintf(f, "  \"swapchain_images\": %u,\n", window->image_count);
+    }
+    fprintf(f, "  \"frames\": %zu,\n", frame_time.count);
+    write_summary(f, "frame_time_ms", &frame_time);
+    fprintf(f, "  \"fps\": %.2f,\n",
+            frame_time.mean > 0 ? 1000.0 / frame_time.mean : 0.0);
+    if (presentation_available(&display->presentation)) {
+        // latency only counts frames that made it to the screen
+        fprintf(f, "  \"frames_presented\": %u,\n",
+                display->presentation.presented);
+        fprintf(f, "  \"frames_discarded\": %u,\n",
+                display->presentation.discarded);
+        write_summary(f, "present_latency_ms", &latency);
+    }
+    if (options->pacing) {
+        // target is the vblank the pacer planned for, actual the feedback
+        struct presentation *presentation = &display->presentation;
+        fprintf(f, "  \"pacing_margin_ms\": %.4f,\n",
+                display->pacer.margin_ns / 1e6);
+        fprintf(f, "  \"deadlines_hit\": %u,\n",
+                presentation->deadlines_hit);
+        fprintf(f, "  \"deadlines_missed\": %u,\n",
+                presentation->deadlines_missed);
+        series_summarize(&presentation->deadline_error, &deadline_error);
+        write_summary(f, "deadline_error_ms", &deadline_error);
+    }
+    if (options->damage) {
+        // share of the pixels of all windows and frames, skipped or not,
+        // that were actually rendered
+        uint64_t pixels = 0;
+        for (uint32_t i = 0; i < display->window_count; i++)
+            pixels += (uint64_t)display->frames_done *
+                      display->windows[i].width * display->windows[i].height;
+        fprintf(f, "  \"frames_skipped\": %u,\n", vk->frames_skipped);
+        fprintf(f, "  \"frames_partial\": %u,\n", vk->frames_partial);
+        fprintf(f, "  \"pixels_rendered_ratio\": %.6f,\n",
+                pixels ? (double)vk->pixels_rendered / pixels : 0.0);
+        fprintf(f, "  \"incremental_present\": %s,\n",
+                vk->incremental_present ? "true" : "false");
+    }
+    if (vk->capture_path) {
+        // dropped frames found the writer still busy with all slots
+        fprintf(f, "  \"frames_captured\": %" PRIu64 ",\n",
+                vk->capture.frames_captured);
+        fprintf(f, "  \"frames_dropped\": %" PRIu64 ",\n",
+                vk->capture.frames_dropped);
+        fprintf(f, "  \"capture_bytes\": %" PRIu64 ",\n",
+                vk->capture.bytes_written);
+        fprintf(f, "  \"capture_failed\": %s,\n",
+                vk->capture.write_failed ? "true" : "false");
+    }
+    // Transient attachments of the first window as requested and as backed
+    // by the driver. With lazily allocated memory the difference is what
+    // they saved.
+    fprintf(f, "  \"msaa_samples\": %u,\n", vk->samples);
+    fprintf(f, "  \"depth\": %s,\n", vk->depth ? "true" : "false");
+    fprintf(f, "  \"transient_lazy\": %s,\n",
+            window->attachments.lazy ? "true" : "false");
+    fprintf(f, "  \"transient_bytes\": %" PRIu64 ",\n",
+            (uint64_t)window->attachments.bytes);
+    fprintf(f, "  \"transient_committed_bytes\": %" PRIu64 ",\n",
+            (uint64_t)attachments_committed(&window->attachments));
+    write_memory_stats(f, &vk->allocator);
+    fprintf(f, "}\n");
+
+    if (f != stdout)
+        fclose(f);
+}
+
+static void init_wayland(struct display *display) {
+    display->wl_display = wl_display_connect(NULL);
+    assert(display->wl_display);
+
+    display->wl_registory = wl_display_get_registry(display->wl_display);
+    wl_registry_add_listener(display->wl_registory, &wl_registry_listener,
+                             display);
+    wl_display_roundtrip(display->wl_display);
+    assert(display->xdg_wm_base && display->wl_compositor);
+
+    for (uint32_t i = 0; i < display->window_count; i++) {
+        struct window *window = &display->windows[i];
+
+        window->wl_surface =
+            wl_compositor_create_surface(display->wl_compositor);
+        window->xdg_surface = xdg_wm_base_get_xdg_surface(display->xdg_wm_base,
+                                                          window->wl_surface);
+        xdg_surface_add_listener(window->xdg_surface, &xdg_surface_listener,
+                                 window);
+        window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
+        xdg_toplevel_add_listener(window->xdg_toplevel,
+                                  &xdg_toplevel_listener, window);
+        window->wait_for_configure = true;
+        wl_surface_commit(window->wl_surface);
+    }
+
+    for (uint32_t i = 0; i < display->window_count; i++)
+        while (display->windows[i].wait_for_configure)
+            wl_display_dispatch(display->wl_display);
+}
+
+// Renders the requested number of frames, paced by a timerfd if --fps is set.
+static void run_headless(struct display *display) {
+    struct vk *vk = &display->vk;
+    uint32_t frames = display->options.frames;
+    int timer = -1;
+
+    if (display->options.fps) {
+        long interval = 1000000000l / display->options.fps;
+        struct timespec period = {interval / 1000000000l,
+                                  interval % 1000000000l};
+
+        timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        assert(timer >= 0);
+        timerfd_settime(timer, 0,
+                        &(struct itimerspec){
+                            .it_interval = period,
+                            .it_value = period,
+                        },
+                        NULL);
+    }
+
+    for (uint32_t i = 0; i < frames; i++) {
+        if (timer >= 0) {
+            // blocks until the next tick; missed ticks are not made up
+            uint64_t expirations;
+            if (read(timer, &expirations, sizeof(expirations)) < 0 &&
+                errno != EINTR)
+                break;
+        }
+        struct window *windows[MAX_WINDOWS];
+        if (vk->track_damage)
+            update_scene(display);
+        uint32_t count = ready_windows(display, windows);
+        if (count)
+            redraw(display, windows, count);
+        else
+            vk->frames_skipped++;
+        frame_done(display, i);
+    }
+
+    if (timer >= 0)
+        close(timer);
+}
+
+static bool windows_open(const struct display *display) {
+    for (uint32_t i = 0; i < display->window_count; i++)
+        if (!display->windows[i].closed)
+            return true;
+    return false;
+}
+
+// Sleeps in poll() on the Wayland socket and only draws a window once the
+// frame callback of its previous frame arrived. A hidden window gets no
+// frame callbacks, so it stops rendering and takes no CPU time. Windows
+// that are ready together are drawn in one frame. With pacing, the frame
+// is further held back on a timerfd until the pacer's wake-up time. The
+// timer runs on timer_clock, which need not be the presentation clock.
+static void wayland_loop(struct display *display, int timer,
+                         clockid_t timer_clock) {
+    struct wl_display *wl_display = display->wl_display;
+    struct vk *vk = &display->vk;
+    struct presentation *presentation = &display->presentation;
+    struct pacer *pacer = &display->pacer;
+    uint32_t frames = display->options.frames;
+    bool pacing = timer >= 0;
+    struct pollfd fds[] = {
+        {.fd = wl_display_get_fd(wl_display), .events = POLLIN},
+        {.fd = timer, .events = POLLIN},
+    };
+
+    for (uint32_t i = 0; (!frames || i < frames) && windows_open(display);) {
+        while (wl_display_prepare_read(wl_display) != 0) {
+            if (wl_display_dispatch_pending(wl_display) == -1)
+                return;
+        }
+
+        // an unchanged window is not drawn until something happens
+        struct window *windows[MAX_WINDOWS];
+        if (vk->track_damage)
+            update_scene(display);
+        uint32_t count = ready_windows(display, windows);
+        if (count) {
+            uint64_t now = presentation_now(presentation);
+            if (pacing && !pacer->wake_ns)
+                pacer_schedule(pacer, presentation, now);
+
+            if (!pacing || now >= pacer->wake_ns) {
+                wl_display_cancel_read(wl_display);
+                redraw(display, windows, count);
+                frame_done(display, i++);
+                if (pacing)
+                    pacer_frame_done(pacer,
+                                     presentation_now(presentation) - now,
+                                     vk->profiler.last_gpu_ns);
+                continue;
+            }
+
+            // the offset between the clocks is measured right before use,
+            // wake_ns is still ahead of now here
+            uint64_t wake_ns = pacer->wake_ns;
+            if (timer_clock != presentation->clock_id)
+                wake_ns = wake_ns - now + now_ns();
+            timerfd_settime(timer, TFD_TIMER_ABSTIME,
+                            &(struct itimerspec){
+                                .it_value = {wake_ns / 1000000000u,
+                                             wake_ns % 1000000000u},
+                            },
+                            NULL);
+        }
+
+        // a full socket buffer also wakes us up once it drains
+        fds[0].events = POLLIN;
+        if (wl_display_flush(wl_display) == -1) {
+            if (errno != EAGAIN) {
+                wl_display_cancel_read(wl_display);
+                return;
+            }
+            fds[0].events |= POLLOUT;
+        }
+
+        // an idle scene still wakes up for the next blink
+        int timeout = -1;
+        if (!count && vk->blink_ms) {
+            uint64_t now = now_ns(), next = vk->next_blink_ns;
+            timeout = next > now ? (next - now + 999999) / 1000000 : 0;
+        }
+        if (poll(fds, ARRAY_LENGTH(fds), timeout) == -1) {
+            wl_display_cancel_read(wl_display);
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            read(timer, &expirations, sizeof(expirations));
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if (wl_display_read_events(wl_display) == -1)
+                return;
+        } else {
+            wl_display_cancel_read(wl_display);
+        }
+        if (fds[0].revents & (POLLERR | POLLHUP))
+            return;
+        if (wl_display_dispatch_pending(wl_display) == -1)
+            return;
+    }
+}
+
+static void run_wayland(struct display *display) {
+    struct presentation *presentation = &display->presentation;
+    int timer = -1;
+    clockid_t timer_clock = presentation->clock_id;
+
+    if (display->options.pacing) {
+        if (!presentation_available(presentation))
+            fprintf(stderr, "no wp_presentation, frames are not paced\n");
+        pacer_init(&display->pacer);
+        // timerfd takes neither the raw nor the coarse clocks, which a
+        // compositor may present with
+        timer = timerfd_create(timer_clock, TFD_CLOEXEC);
+        if (timer < 0 && errno == EINVAL) {
+            timer_clock = CLOCK_MONOTONIC;
+            timer = timerfd_create(timer_clock, TFD_CLOEXEC);
+        }
+        assert(timer >= 0);
+    }
+
+    wayland_loop(display, timer, timer_clock);
+
+    if (timer >= 0)
+        close(timer);
+}
+
+int main(int argc, char *argv[]) {
+    struct display display = {.start_ns = now_ns()};
+    struct vk *vk = &display.vk;
+    parse_options(&display.options, argc, argv);
+    vk->headless = display.options.headless;
+    vk->frame_count = display.options.frames_in_flight;
+    vk->instance_count = display.options.instances;
+    vk->separate_draws = display.options.separate_draws;
+    vk->cached_commands = display.options.cached_commands;
+    vk->record_threads = display.options.threads;
+    vk->cull = display.options.cull;
+    vk->zoom = display.options.zoom;
+    vk->simulate = display.options.simulate;
+    vk->mesh_path = display.options.mesh_path;
+    vk->variant = display.options.variant;
+    vk->cycle_frames = display.options.cycle_variants;
+    vk->msaa = display.options.msaa;
+    vk->depth = display.options.depth;
+    vk->track_damage = display.options.damage;
+    vk->blink_ms = display.options.blink_ms;
+    vk->capture_path = display.options.capture_path;
+    vk->capture_format = display.options.capture_format;
+    display.window_count = display.options.windows;
+    for (uint32_t i = 0; i < display.window_count; i++) {
+        struct window *window = &display.windows[i];
+        window->display = &display;
+        window->id = i;
+        window->width = display.options.width;
+        window->height = display.options.height;
+    }
+
+    if (!display.options.headless)
+        init_wayland(&display);
+
+    init_vulkan(&display);
+    // before the swapchains, cached command buffers record the queries. The
+    // pacer needs the GPU times even without a trace.
+    if (display.options.trace_path || display.options.pacing)
+        profiler_init(&vk->profiler, vk->physical_device, vk->device,
+                      vk->queue_family, display.options.trace_path);
+    for (uint32_t i = 0; i < display.window_count; i++)
+        create_swapchain(&display.windows[i]);
+
+    display.last_frame_ns = now_ns();
+    if (display.options.headless)
+        run_headless(&display);
+    else
+        run_wayland(&display);
+
+    // Every frame and upload ends on the graphics queue with a timeline
+    // value, after waiting for the compute and transfer work it needs.
+    sync_wait_idle(&vk->sync);
+    // the saved cache then holds every variant
+    thread_pool_wait(&vk->compile_pool);
+    thread_pool_finish(&vk->compile_pool);
+    pipeline_cache_save(vk->device, vk->pipeline_cache);
+    profiler_finish(&vk->profiler);
+    uploader_finish(&vk->uploader);
+    thread_pool_finish(&vk->record_pool);
+    culler_finish(&vk->culler, &vk->allocator);
+    simulation_finish(&vk->sim, &vk->allocator);
+    mesh_finish(&vk->mesh, &vk->allocator);
+    if (vk->capture_path) {
+        capture_finish(&vk->capture);
+        if (vk->capture.write_failed)
+            fprintf(stderr, "writing the capture failed\n");
+    }
+    if (display.options.stats_path)
+        write_stats(&display);
+    for (uint32_t i = 0; i < display.window_count; i++) {
+        struct window *window = &display.windows[i];
+
+        for (uint32_t j = 0; j < window->image_count; j++) {
+            struct window_buffer *win_buffer = &window->win_buffers[j];
+            vkDestroyFramebuffer(vk->device, win_buffer->framebuffer, NULL);
+            vkDestroyImageView(vk->device, win_buffer->view, NULL);
+            // swapchain images belong to the swapchain
+            if (vk->headless) {
+                vkDestroyImage(vk->device, win_buffer->image, NULL);
+                mem_free(&vk->allocator, &win_buffer->alloc);
+            }
+        }
+        attachments_destroy(&window->attachments, &vk->allocator);
+    }
+    sync_finish(&vk->sync);
+    destroy_buffer(&vk->allocator, &vk->vert_buffer);
+    destroy_buffer(&vk->allocator, &vk->instance_buffer);
+    destroy_buffer(&vk->allocator, &vk->uniform_buffer);
+    // reports whatever is still allocated
+    allocator_finish(&vk->allocator);
+    series_finish(&display.frame_times);
+    presentation_finish(&display.presentation);
 
     return 0;
 }
@@ -0,0 +1,317 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "memory.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+void allocator_init(struct allocator *allocator,
+                    VkPhysicalDevice physical_device, VkDevice device) {
+    VkPhysicalDeviceProperties props;
+
+    memset(allocator, 0, sizeof(*allocator));
+    allocator->device = device;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &allocator->props);
+    vkGetPhysicalDeviceProperties(physical_device, &props);
+    allocator->granularity = MAX(props.limits.bufferImageGranularity, 1);
+    allocator->max_allocations = props.limits.maxMemoryAllocationCount;
+}
+
+static void destroy_block(struct allocator *allocator, struct mem_block *block) {
+    while (block->free_list) {
+        struct mem_range *range = block->free_list;
+        block->free_list = range->next;
+        free(range);
+    }
+    // freeing memory implicitly unmaps it
+    vkFreeMemory(allocator->device, block->memory, NULL);
+    allocator->device_allocations--;
+    free(block);
+}
+
+void allocator_finish(struct allocator *allocator) {
+    for (uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; i++) {
+        while (allocator->blocks[i]) {
+            struct mem_block *block = allocator->blocks[i];
+            allocator->blocks[i] = block->next;
+            if (block->allocation_count)
+                fprintf(stderr, "leaking %u allocations of memory type %u\n",
+                        block->allocation_count, i);
+            destroy_block(allocator, block);
+        }
+    }
+}
+
+uint32_t allocator_find_type(const struct allocator *allocator,
+                             uint32_t type_bits, VkMemoryPropertyFlags required,
+                             VkMemoryPropertyFlags preferred) {
+    uint32_t best = UINT32_MAX;
+    int best_score = INT_MIN;
+
+    for (uint32_t i = 0; i < allocator->props.memoryTypeCount; i++) {
+        VkMemoryPropertyFlags flags =
+            allocator->props.memoryTypes[i].propertyFlags;
+
+        if (!(type_bits & (1u << i)) || (flags & required) != required)
+            continue;
+        // protected memory cannot be mapped or used by regular submits
+        if ((flags & VK_MEMORY_PROPERTY_PROTECTED_BIT) &&
+            !(required & VK_MEMORY_PROPERTY_PROTECTED_BIT))
+            continue;
+
+        // CPU reads from uncached memory are slow enough to outweigh any
+        // other preference, a non-coherent type only costs an invalidate
+        int score = 2 * __builtin_popcount(flags & preferred);
+        if (flags & preferred & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)
+            score += 2;
+        // Device-local memory nobody asked for is usually the small
+        // host-visible window of VRAM, which is kept for those who do. On
+        // unified memory every type has the bit, so nothing changes there.
+        if ((flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) &&
+            !((required | preferred) & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+            score -= 1;
+        if (score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static struct mem_block *create_block(struct allocator *allocator,
+                                      uint32_t type_index, VkDeviceSize size) {
+    const VkMemoryType *type = &allocator->props.memoryTypes[type_index];
+    VkDeviceSize heap_size = allocator->props.memoryHeaps[type->heapIndex].size;
+
+    // small heaps, like the host-visible window of VRAM, get smaller blocks
+    VkDeviceSize block_size = MIN((VkDeviceSize)DEFAULT_BLOCK_SIZE,
+                                  MAX(heap_size / 8, 1u << 20));
+    block_size = MAX(block_size, size);
+
+    if (allocator->max_allocations &&
+        allocator->device_allocations >= allocator->max_allocations)
+        return NULL;
+
+    struct mem_block *block = calloc(1, sizeof(*block));
+    assert(block);
+    if (vkAllocateMemory(allocator->device,
+                         &(VkMemoryAllocateInfo){
+                             .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                             .allocationSize = block_size,
+                             .memoryTypeIndex = type_index,
+                         },
+                         NULL, &block->memory) != VK_SUCCESS) {
+        free(block);
+        return NULL;
+    }
+    allocator->device_allocations++;
+
+    if (type->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+        vkMapMemory(allocator->device, block->memory, 0, VK_WHOLE_SIZE, 0,
+                    &block->map);
+
+    block->size = block_size;
+    block->type_index = type_index;
+    block->free_list = malloc(sizeof(*block->free_list));
+    assert(block->free_list);
+    *block->free_list = (struct mem_range){.offset = 0, .size = block_size};
+
+    block->next = allocator->blocks[type_index];
+    allocator->blocks[type_index] = block;
+    return block;
+}
+
+// First fit. Leading alignment padding stays on the free list.
+static bool block_alloc(struct mem_block *block, VkDeviceSize size,
+                        VkDeviceSize alignment, VkDeviceSize *offset) {
+    for (struct mem_range **link = &block->free_list, *range; (range = *link);
+         link = &range->next) {
+        VkDeviceSize start = ALIGN_UP(range->offset, alignment);
+        VkDeviceSize end = range->offset + range->size;
+
+        if (start + size > end)
+            continue;
+
+        if (start + size < end) {
+            struct mem_range *tail = malloc(sizeof(*tail));
+            assert(tail);
+            *tail = (struct mem_range){
+                .offset = start + size,
+                .size = end - start - size,
+                .next = range->next,
+            };
+            range->next = tail;
+        }
+        if (start > range->offset) {
+            range->size = start - range->offset;
+        } else {
+            *link = range->next;
+            free(range);
+        }
+
+        *offset = start;
+        block->used += size;
+        block->allocation_count++;
+        return true;
+    }
+    return false;
+}
+
+static void block_free(struct mem_block *block, VkDeviceSize offset,
+                       VkDeviceSize size) {
+    struct mem_range *prev = NULL, *next = block->free_list;
+    while (next && next->offset < offset) {
+        prev = next;
+        next = next->next;
+    }
+
+    if (prev && prev->offset + prev->size == offset) {
+        prev->size += size;
+    } else {
+        struct mem_range *range = malloc(sizeof(*range));
+        assert(range);
+        *range = (struct mem_range){.offset = offset, .size = size, .next = next};
+        if (prev)
+            prev->next = range;
+        else
+            block->free_list = range;
+        prev = range;
+    }
+    if (next && prev->offset + prev->size == next->offset) {
+        prev->size += next->size;
+        prev->next = next->next;
+        free(next);
+    }
+
+    block->used -= size;
+    block->allocation_count--;
+}
+
+bool mem_alloc(struct allocator *allocator, const VkMemoryRequirements *reqs,
+               VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+               bool linear, struct allocation *allocation) {
+    uint32_t type_index = allocator_find_type(allocator, reqs->memoryTypeBits,
+                                              required, preferred);
+    if (type_index == UINT32_MAX)
+        return false;
+
+    VkDeviceSize size = reqs->size;
+    VkDeviceSize alignment = MAX(reqs->alignment, 1);
+    if (!linear) {
+        // give optimal images whole granularity pages, so that no linear
+        // resource can end up on the same page
+        alignment = MAX(alignment, allocator->granularity);
+        size = ALIGN_UP(size, allocator->granularity);
+    }
+
+    struct mem_block *block;
+    VkDeviceSize offset;
+    for (block = allocator->blocks[type_index]; block; block = block->next) {
+        if (block_alloc(block, size, alignment, &offset))
+            break;
+    }
+    if (!block) {
+        block = create_block(allocator, type_index, size);
+        if (!block || !block_alloc(block, size, alignment, &offset))
+            return false;
+    }
+
+    *allocation = (struct allocation){
+        .block = block,
+        .memory = block->memory,
+        .offset = offset,
+        .size = size,
+        .map = block->map ? (char *)block->map + offset : NULL,
+    };
+    return true;
+}
+
+void mem_free(struct allocator *allocator, struct allocation *allocation) {
+    struct mem_block *block = allocation->block;
+    if (!block)
+        return;
+
+    block_free(block, allocation->offset, allocation->size);
+    memset(allocation, 0, sizeof(*allocation));
+
+    // release empty blocks, but keep the last one of a type around so that
+    // a free/alloc pattern does not hit vkAllocateMemory every time
+    struct mem_block **link = &allocator->blocks[block->type_index];
+    if (block->allocation_count || (*link == block && !block->next))
+        return;
+    while (*link != block)
+        link = &(*link)->next;
+    *link = block->next;
+    destroy_block(allocator, block);
+}
+
+struct buffer create_buffer(struct allocator *allocator, VkDeviceSize size,
+                            VkBufferUsageFlags usage_flags,
+                            VkMemoryPropertyFlags required,
+                            VkMemoryPropertyFlags preferred) {
+    return create_shared_buffer(allocator, size, usage_flags, required,
+                                preferred, NULL, 0);
+}
+
+struct buffer create_shared_buffer(struct allocator *allocator,
+                                   VkDeviceSize size,
+                                   VkBufferUsageFlags usage_flags,
+                                   VkMemoryPropertyFlags required,
+                                   VkMemoryPropertyFlags preferred,
+                                   const uint32_t *families,
+                                   uint32_t family_count) {
+    struct buffer buffer = {.size = size};
+
+    vkCreateBuffer(allocator->device,
+                   &(VkBufferCreateInfo){
+                       .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                       .size = size,
+                       .usage = usage_flags,
+                       .sharingMode = family_count > 1
+                                          ? VK_SHARING_MODE_CONCURRENT
+                                          : VK_SHARING_MODE_EXCLUSIVE,
+                       .queueFamilyIndexCount =
+                           family_count > 1 ? family_count : 0,
+                       .pQueueFamilyIndices = families,
+                   },
+                   NULL, &buffer.buffer);
+    VkMemoryRequirements reqs;
+    vkGetBufferMemoryRequirements(allocator->device, buffer.buffer, &reqs);
+
+    bool ok =
+        mem_alloc(allocator, &reqs, required, preferred, true, &buffer.alloc);
+    assert(ok);
+
+    vkBindBufferMemory(allocator->device, buffer.buffer, buffer.alloc.memory,
+                       buffer.alloc.offset);
+    buffer.map = buffer.alloc.map;
+
+    return buffer;
+}
+
+void destroy_buffer(struct allocator *allocator, struct buffer *buffer) {
+    vkDestroyBuffer(allocator->device, buffer->buffer, NULL);
+    mem_free(allocator, &buffer->alloc);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+void allocator_type_stats(const struct allocator *allocator,
+                          uint32_t type_index,
+                          struct memory_type_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (const struct mem_block *block = allocator->blocks[type_index]; block;
+         block = block->next) {
+        stats->blocks++;
+        stats->allocations += block->allocation_count;
+        stats->reserved += block->size;
+        stats->used += block->used;
+        for (const struct mem_range *range = block->free_list; range;
+             range = range->next)
+            stats->largest_free = MAX(stats->largest_free, range->size);
+    }
+}
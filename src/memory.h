@@ -0,0 +1,92 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#define DEFAULT_BLOCK_SIZE (64u << 20)
+
+struct mem_range {
+    VkDeviceSize offset, size;
+    struct mem_range *next;
+};
+
+// One vkAllocateMemory, carved up into sub-allocations.
+struct mem_block {
+    VkDeviceMemory memory;
+    VkDeviceSize size, used;
+    uint32_t type_index;
+    uint32_t allocation_count;
+    void *map; // whole block, persistently mapped if host visible
+    struct mem_range *free_list; // sorted by offset, neighbours coalesced
+    struct mem_block *next;
+};
+
+struct allocation {
+    struct mem_block *block;
+    VkDeviceMemory memory;
+    VkDeviceSize offset, size;
+    void *map;
+};
+
+struct buffer {
+    VkBuffer buffer;
+    struct allocation alloc;
+    VkDeviceSize size;
+    void *map; // persistently mapped if host visible
+};
+
+struct allocator {
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties props;
+    VkDeviceSize granularity; // bufferImageGranularity
+    uint32_t max_allocations;
+    uint32_t device_allocations;
+    struct mem_block *blocks[VK_MAX_MEMORY_TYPES];
+};
+
+struct memory_type_stats {
+    uint32_t blocks, allocations;
+    VkDeviceSize reserved, used, largest_free;
+};
+
+void allocator_init(struct allocator *allocator,
+                    VkPhysicalDevice physical_device, VkDevice device);
+void allocator_finish(struct allocator *allocator);
+
+// Returns the memory type allowed by type_bits that has all required
+// properties and as many preferred ones as possible, or UINT32_MAX. A
+// preferred HOST_CACHED counts as two. Between otherwise equal types, one
+// without DEVICE_LOCAL wins unless that was asked for.
+uint32_t allocator_find_type(const struct allocator *allocator,
+                             uint32_t type_bits, VkMemoryPropertyFlags required,
+                             VkMemoryPropertyFlags preferred);
+
+// Sub-allocates memory for a resource. linear is true for buffers and
+// linear images; optimal-tiling images are kept on their own
+// bufferImageGranularity pages so they never alias a linear resource.
+bool mem_alloc(struct allocator *allocator, const VkMemoryRequirements *reqs,
+               VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+               bool linear, struct allocation *allocation);
+void mem_free(struct allocator *allocator, struct allocation *allocation);
+
+struct buffer create_buffer(struct allocator *allocator, VkDeviceSize size,
+                            VkBufferUsageFlags usage_flags,
+                            VkMemoryPropertyFlags required,
+                            VkMemoryPropertyFlags preferred);
+// Like create_buffer, but usable from all the given queue families at once,
+// without ownership transfers. One family makes it exclusive.
+struct buffer create_shared_buffer(struct allocator *allocator,
+                                   VkDeviceSize size,
+                                   VkBufferUsageFlags usage_flags,
+                                   VkMemoryPropertyFlags required,
+                                   VkMemoryPropertyFlags preferred,
+                                   const uint32_t *families,
+                                   uint32_t family_count);
+void destroy_buffer(struct allocator *allocator, struct buffer *buffer);
+
+void allocator_type_stats(const struct allocator *allocator,
+                          uint32_t type_index, struct memory_type_stats *stats);
+
+#endif
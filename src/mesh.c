@@ -0,0 +1,182 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "mesh.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "vertex_format.h"
+
+// Checks that [offset, offset + count * size) lies inside the file.
+static bool in_file(const struct mesh *mesh, uint64_t offset, uint64_t count,
+                    uint64_t size) {
+    return offset <= mesh->map_size &&
+           count <= (mesh->map_size - offset) / size;
+}
+
+static const char *validate(const struct mesh *mesh) {
+    const struct mesh_header *h = mesh->header;
+
+    if (mesh->map_size < sizeof(*h) || h->magic != MESH_MAGIC)
+        return "not a mesh file";
+    if (h->version != MESH_VERSION)
+        return "unsupported version";
+    if (h->vertex_format != VERTEX_FORMAT || h->vertex_stride != VERTEX_STRIDE)
+        return "vertex format differs from the build's, convert with "
+               "meshconv --vertex-format " VERTEX_FORMAT_NAME;
+    if (h->index_size != 2 && h->index_size != 4)
+        return "unsupported index size";
+    if (h->index_count > UINT32_MAX)
+        return "too many indices";
+    if (h->chunk_count > UINT32_MAX)
+        return "too many chunks";
+    if (h->chunk_offset % sizeof(uint64_t) ||
+        !in_file(mesh, h->chunk_offset, h->chunk_count,
+                 sizeof(struct mesh_chunk)) ||
+        !in_file(mesh, h->vertex_offset, h->vertex_count, h->vertex_stride) ||
+        !in_file(mesh, h->index_offset, h->index_count, h->index_size))
+        return "truncated";
+
+    // Chunks must tile both blobs in order, see mesh_format.h. The index
+    // values are left to the converter, checking them would mean reading
+    // the whole file before the first frame.
+    const struct mesh_chunk *chunks =
+        (const struct mesh_chunk *)(mesh->map + h->chunk_offset);
+    uint64_t vertices = 0, indices = 0;
+    for (uint64_t i = 0; i < h->chunk_count; i++) {
+        if (chunks[i].first_vertex != vertices ||
+            chunks[i].first_index != indices ||
+            chunks[i].index_count % 3)
+            return "bad chunk table";
+        vertices += chunks[i].vertex_count;
+        indices += chunks[i].index_count;
+    }
+    if (vertices != h->vertex_count || indices != h->index_count)
+        return "bad chunk table";
+
+    return NULL;
+}
+
+bool mesh_open(struct mesh *mesh, const char *path) {
+    *mesh = (struct mesh){.open_ns = now_ns()};
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        fprintf(stderr, "%s: empty or unreadable\n", path);
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return false;
+    }
+    mesh->map = map;
+    mesh->map_size = st.st_size;
+    mesh->header = map;
+
+    const char *error = validate(mesh);
+    if (error) {
+        fprintf(stderr, "%s: %s\n", path, error);
+        munmap(map, st.st_size);
+        *mesh = (struct mesh){0};
+        return false;
+    }
+    mesh->chunks =
+        (const struct mesh_chunk *)(mesh->map + mesh->header->chunk_offset);
+
+    // the blobs are read front to back exactly once
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+    return true;
+}
+
+void mesh_create_buffers(struct mesh *mesh, struct allocator *allocator) {
+    const struct mesh_header *h = mesh->header;
+
+    mesh->vertices = create_buffer(
+        allocator, MAX(h->vertex_count * h->vertex_stride, 1),
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+    mesh->indices = create_buffer(
+        allocator, MAX(h->index_count * h->index_size, 1),
+        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+}
+
+void mesh_finish(struct mesh *mesh, struct allocator *allocator) {
+    if (!mesh->map)
+        return;
+    destroy_buffer(allocator, &mesh->vertices);
+    destroy_buffer(allocator, &mesh->indices);
+    munmap((void *)mesh->map, mesh->map_size);
+}
+
+// Asks the kernel to start reading a range we will copy soon. The mapping
+// starts at a page boundary, so rounding down to one stays inside it.
+static void prefetch(const struct mesh *mesh, uint64_t offset, uint64_t size) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset % page;
+    posix_madvise((void *)(mesh->map + start), size + offset - start,
+                  POSIX_MADV_WILLNEED);
+}
+
+bool mesh_stream(struct mesh *mesh, struct uploader *uploader,
+                 VkDeviceSize budget) {
+    const struct mesh_header *h = mesh->header;
+    VkDeviceSize queued = 0;
+    uint32_t first = mesh->next_chunk;
+
+    while (mesh->next_chunk < h->chunk_count) {
+        const struct mesh_chunk *c = &mesh->chunks[mesh->next_chunk];
+        VkDeviceSize vertex_bytes = c->vertex_count * h->vertex_stride;
+        VkDeviceSize index_bytes = c->index_count * h->index_size;
+
+        if (mesh->next_chunk > first &&
+            queued + vertex_bytes + index_bytes > budget)
+            break;
+
+        upload_buffer(uploader, mesh->vertices.buffer,
+                      c->first_vertex * h->vertex_stride,
+                      mesh->map + h->vertex_offset +
+                          c->first_vertex * h->vertex_stride,
+                      vertex_bytes);
+        upload_buffer(uploader, mesh->indices.buffer,
+                      c->first_index * h->index_size,
+                      mesh->map + h->index_offset +
+                          c->first_index * h->index_size,
+                      index_bytes);
+        queued += vertex_bytes + index_bytes;
+        mesh->ready_indices = c->first_index + c->index_count;
+        mesh->next_chunk++;
+    }
+    if (mesh->next_chunk == first)
+        return false;
+    upload_flush(uploader);
+
+    if (mesh->next_chunk < h->chunk_count) {
+        const struct mesh_chunk *c = &mesh->chunks[mesh->next_chunk];
+        prefetch(mesh, h->vertex_offset + c->first_vertex * h->vertex_stride,
+                 c->vertex_count * h->vertex_stride);
+        prefetch(mesh, h->index_offset + c->first_index * h->index_size,
+                 c->index_count * h->index_size);
+    }
+
+    uint64_t now = now_ns();
+    if (first == 0)
+        mesh->first_chunk_ns = now - mesh->open_ns;
+    if (mesh_complete(mesh))
+        mesh->complete_ns = now - mesh->open_ns;
+    return true;
+}
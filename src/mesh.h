@@ -0,0 +1,50 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "memory.h"
+#include "mesh_format.h"
+#include "upload.h"
+
+// A .mesh file mapped into memory and streamed to the GPU a few chunks per
+// frame. Chunks are copied from the mapping straight into staging memory,
+// so the file contents never pass through the heap, and drawing starts as
+// soon as the first chunk has been flushed.
+struct mesh {
+    const uint8_t *map;
+    size_t map_size;
+    const struct mesh_header *header;
+    const struct mesh_chunk *chunks;
+
+    struct buffer vertices, indices;
+    uint32_t next_chunk;
+    uint32_t ready_indices; // drawable by anything submitted from now on
+
+    uint64_t open_ns, first_chunk_ns, complete_ns;
+};
+
+// Maps path and checks the header and chunk table. Prints why and returns
+// false if it is not a mesh this build can draw.
+bool mesh_open(struct mesh *mesh, const char *path);
+void mesh_create_buffers(struct mesh *mesh, struct allocator *allocator);
+void mesh_finish(struct mesh *mesh, struct allocator *allocator);
+
+// Uploads the next chunks, at least one and otherwise no more than budget
+// bytes, and flushes them. Returns true if ready_indices grew.
+bool mesh_stream(struct mesh *mesh, struct uploader *uploader,
+                 VkDeviceSize budget);
+
+static inline VkIndexType mesh_index_type(const struct mesh *mesh) {
+    return mesh->header->index_size == 2 ? VK_INDEX_TYPE_UINT16
+                                         : VK_INDEX_TYPE_UINT32;
+}
+
+static inline bool mesh_complete(const struct mesh *mesh) {
+    return mesh->next_chunk == mesh->header->chunk_count;
+}
+
+#endif
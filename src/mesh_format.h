@@ -0,0 +1,47 @@
+#ifndef MESH_FORMAT_H
+#define MESH_FORMAT_H
+
+#include <stdint.h>
+
+// On-disk layout of .mesh files, shared by the loader and tools/meshconv.
+// Everything is little endian:
+//
+//   header | chunk table | pad | vertex blob | pad | index blob
+//
+// The blobs start on MESH_ALIGNMENT so that a mapping of the file hands
+// out whole pages per chunk. Indices are uint16 or uint32, vertices use one
+// of the layouts in vertex_format.h. Chunks cover consecutive
+// ranges of both blobs, and the indices of chunk n only refer to vertices
+// of chunks 0..n, so any prefix of the chunks is a drawable mesh.
+
+#define MESH_MAGIC 0x4853454du // "MESH"
+#define MESH_VERSION 2
+#define MESH_ALIGNMENT 4096
+
+enum mesh_vertex_format {
+    MESH_VERTEX_FLOAT32 = 0, // float position[3], float color[3]
+    MESH_VERTEX_HALF = 1,    // half position[4], unorm8 color[4]
+    MESH_VERTEX_SNORM16 = 2, // snorm16 position[4], unorm8 color[4]
+};
+
+struct mesh_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertex_format; // enum mesh_vertex_format
+    uint32_t vertex_stride;
+    uint32_t index_size; // 2 or 4 bytes
+    uint32_t pad;
+    uint64_t vertex_count;
+    uint64_t index_count;
+    uint64_t chunk_count;
+    uint64_t chunk_offset; // in bytes from the start of the file
+    uint64_t vertex_offset;
+    uint64_t index_offset;
+};
+
+struct mesh_chunk {
+    uint64_t first_vertex, vertex_count;
+    uint64_t first_index, index_count;
+};
+
+#endif
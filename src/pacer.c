@@ -0,0 +1,91 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "pacer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define INITIAL_MARGIN_NS 2000000u // 2 ms
+#define MIN_MARGIN_NS 500000u
+#define HITS_BEFORE_SHRINK 60 // about a second at 60 Hz
+
+static void window_add(struct sample_window *window, uint64_t sample) {
+    window->samples[window->next] = sample;
+    window->next = (window->next + 1) % PACER_WINDOW;
+    window->count = MIN(window->count + 1, PACER_WINDOW);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Plans for the slow frames rather than the typical one. Sorting 64
+// samples once per frame is cheap enough.
+static uint64_t window_p95(const struct sample_window *window) {
+    uint64_t sorted[PACER_WINDOW];
+
+    if (!window->count)
+        return 0;
+    memcpy(sorted, window->samples, window->count * sizeof(sorted[0]));
+    qsort(sorted, window->count, sizeof(sorted[0]), compare_u64);
+    return sorted[window->count * 95 / 100];
+}
+
+void pacer_init(struct pacer *pacer) {
+    *pacer = (struct pacer){
+        .margin_ns = INITIAL_MARGIN_NS,
+    };
+}
+
+static void adapt_margin(struct pacer *pacer,
+                         const struct presentation *presentation) {
+    uint32_t refresh = presentation->refresh_ns;
+
+    if (presentation->deadlines_missed != pacer->seen_misses) {
+        pacer->margin_ns = MIN(2 * pacer->margin_ns, (uint64_t)refresh);
+        pacer->hits_in_row = 0;
+    } else if (presentation->deadlines_hit != pacer->seen_hits) {
+        pacer->hits_in_row += presentation->deadlines_hit - pacer->seen_hits;
+        if (pacer->hits_in_row >= HITS_BEFORE_SHRINK) {
+            pacer->margin_ns =
+                MAX(pacer->margin_ns - pacer->margin_ns / 8, MIN_MARGIN_NS);
+            pacer->hits_in_row = 0;
+        }
+    }
+    pacer->seen_misses = presentation->deadlines_missed;
+    pacer->seen_hits = presentation->deadlines_hit;
+}
+
+void pacer_schedule(struct pacer *pacer,
+                    const struct presentation *presentation, uint64_t now) {
+    uint64_t refresh = presentation->refresh_ns;
+    uint64_t last = presentation->last_present_ns;
+
+    if (!refresh || !last) {
+        pacer->wake_ns = now;
+        pacer->target_ns = 0;
+        return;
+    }
+
+    adapt_margin(pacer, presentation);
+    uint64_t budget =
+        window_p95(&pacer->cpu) + window_p95(&pacer->gpu) + pacer->margin_ns;
+
+    // first vblank after the last presentation that we can still make
+    uint64_t target = last + refresh;
+    if (target < now + budget)
+        target += ALIGN_UP(now + budget - target, refresh);
+
+    pacer->target_ns = target;
+    pacer->wake_ns = target - budget;
+}
+
+void pacer_frame_done(struct pacer *pacer, uint64_t cpu_ns, uint64_t gpu_ns) {
+    window_add(&pacer->cpu, cpu_ns);
+    if (gpu_ns)
+        window_add(&pacer->gpu, gpu_ns);
+    pacer->wake_ns = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+#include "presentation.h"
+
+#define PACER_WINDOW 64 // samples in the moving percentiles
+
+struct sample_window {
+    uint64_t samples[PACER_WINDOW];
+    uint32_t count, next;
+};
+
+// Just-in-time frame scheduling: instead of rendering right after the
+// previous frame, wait until the latest point that still makes the next
+// vblank. The time needed is predicted from recent CPU and GPU times plus
+// a safety margin that grows on misses and slowly shrinks on hits.
+struct pacer {
+    struct sample_window cpu, gpu;
+    uint64_t margin_ns;
+    uint32_t hits_in_row;
+    uint32_t seen_hits, seen_misses; // presentation counters last looked at
+
+    // the frame being scheduled, 0 when none is
+    uint64_t wake_ns, target_ns;
+};
+
+void pacer_init(struct pacer *pacer);
+
+// Picks the presentation time for the next frame and sets wake_ns to when
+// rendering has to start, both on the presentation clock. Without feedback
+// to predict from, the frame starts right away and has no target.
+void pacer_schedule(struct pacer *pacer,
+                    const struct presentation *presentation, uint64_t now);
+
+// Times of a finished frame: CPU time of redraw() and GPU time of its
+// commands, 0 if unknown.
+void pacer_frame_done(struct pacer *pacer, uint64_t cpu_ns, uint64_t gpu_ns);
+
+#endif
@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "pipeline_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_DIR "vulkan-demo"
+#define CACHE_FILE "pipeline-cache.bin"
+
+// Builds the path of the cache file and creates its directory on the way.
+static bool cache_path(char *path, size_t size) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    char dir[PATH_MAX];
+    int n;
+
+    if (base && base[0] == '/') {
+        n = snprintf(dir, sizeof(dir), "%s", base);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home)
+            return false;
+        n = snprintf(dir, sizeof(dir), "%s/.cache", home);
+    }
+    if (n < 0 || (size_t)n >= sizeof(dir))
+        return false;
+    if (mkdir(dir, 0700) && errno != EEXIST)
+        return false;
+
+    n = snprintf(path, size, "%s/" CACHE_DIR, dir);
+    if (n < 0 || (size_t)n >= size)
+        return false;
+    if (mkdir(path, 0700) && errno != EEXIST)
+        return false;
+
+    n = snprintf(path, size, "%s/" CACHE_DIR "/" CACHE_FILE, dir);
+    return n >= 0 && (size_t)n < size;
+}
+
+static void *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    void *data = NULL;
+    long len;
+    if (fseek(f, 0, SEEK_END) || (len = ftell(f)) <= 0 ||
+        fseek(f, 0, SEEK_SET))
+        goto out;
+
+    data = malloc(len);
+    if (data && fread(data, 1, len, f) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    *size = len;
+out:
+    fclose(f);
+    return data;
+}
+
+// Checks that the blob was produced by this very driver and device. The
+// driver would reject a foreign blob too, but some drivers crash on corrupt
+// data instead.
+static bool header_valid(const VkPhysicalDeviceProperties *props,
+                         const void *data, size_t size) {
+    VkPipelineCacheHeaderVersionOne header;
+
+    if (size < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+
+    return header.headerSize >= sizeof(header) && header.headerSize <= size &&
+           header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           header.vendorID == props->vendorID &&
+           header.deviceID == props->deviceID &&
+           memcmp(header.pipelineCacheUUID, props->pipelineCacheUUID,
+                  VK_UUID_SIZE) == 0;
+}
+
+VkPipelineCache pipeline_cache_load(VkPhysicalDevice physical_device,
+                                    VkDevice device, bool *warm) {
+    VkPhysicalDeviceProperties props;
+    char path[PATH_MAX];
+    size_t size = 0;
+    void *data = NULL;
+
+    vkGetPhysicalDeviceProperties(physical_device, &props);
+
+    if (cache_path(path, sizeof(path)))
+        data = read_file(path, &size);
+    if (data && !header_valid(&props, data, size)) {
+        fprintf(stderr, "discarding stale pipeline cache %s\n", path);
+        free(data);
+        data = NULL;
+        size = 0;
+    }
+
+    VkPipelineCache cache;
+    VkResult r = vkCreatePipelineCache(
+        device,
+        &(VkPipelineCacheCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+            .initialDataSize = size,
+            .pInitialData = data,
+        },
+        NULL, &cache);
+    if (r != VK_SUCCESS && data) {
+        // the driver refused the blob, start over with an empty cache
+        free(data);
+        data = NULL;
+        r = vkCreatePipelineCache(
+            device,
+            &(VkPipelineCacheCreateInfo){
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+            },
+            NULL, &cache);
+    }
+    if (r != VK_SUCCESS)
+        cache = VK_NULL_HANDLE;
+
+    *warm = data != NULL;
+    free(data);
+    return cache;
+}
+
+void pipeline_cache_save(VkDevice device, VkPipelineCache cache) {
+    char path[PATH_MAX], tmp_path[PATH_MAX + 8];
+    size_t size;
+
+    if (cache == VK_NULL_HANDLE || !cache_path(path, sizeof(path)))
+        return;
+    if (vkGetPipelineCacheData(device, cache, &size, NULL) != VK_SUCCESS ||
+        !size)
+        return;
+
+    void *data = malloc(size);
+    if (!data)
+        return;
+    if (vkGetPipelineCacheData(device, cache, &size, data) != VK_SUCCESS)
+        goto out;
+
+    // write a temporary file next to the cache and rename it over the old
+    // one, so that a crash never leaves a truncated cache behind
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0)
+        goto out;
+
+    bool ok = true;
+    for (size_t done = 0; ok && done < size;) {
+        ssize_t n = write(fd, (char *)data + done, size - done);
+        if (n < 0 && errno != EINTR)
+            ok = false;
+        else if (n > 0)
+            done += n;
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp_path, path)) {
+        fprintf(stderr, "failed to write pipeline cache %s\n", path);
+        unlink(tmp_path);
+    }
+out:
+    free(data);
+}
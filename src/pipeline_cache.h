@@ -0,0 +1,16 @@
+#ifndef PIPELINE_CACHE_H
+#define PIPELINE_CACHE_H
+
+#include <stdbool.h>
+#include <vulkan/vulkan.h>
+
+// Creates a pipeline cache seeded from the on-disk cache of a previous run.
+// Blobs written by another driver or device are discarded. *warm tells
+// whether any cached data was loaded.
+VkPipelineCache pipeline_cache_load(VkPhysicalDevice physical_device,
+                                    VkDevice device, bool *warm);
+
+// Writes the cache back to disk, replacing the old file atomically.
+void pipeline_cache_save(VkDevice device, VkPipelineCache cache);
+
+#endif
@@ -0,0 +1,120 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "presentation.h"
+
+#include <assert.h>
+#include <presentation-time-protocol.h>
+#include <stdlib.h>
+
+struct feedback {
+    struct presentation *presentation;
+    uint64_t submit_ns, target_ns;
+    bool measure;
+};
+
+static void presentation_handle_clock_id(void *data,
+                                         struct wp_presentation *wp,
+                                         uint32_t clock_id) {
+    struct presentation *presentation = data;
+    presentation->clock_id = clock_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+    presentation_handle_clock_id,
+};
+
+void presentation_bind(struct presentation *presentation,
+                       struct wl_registry *registry, uint32_t name,
+                       uint32_t version) {
+    presentation->clock_id = CLOCK_MONOTONIC;
+    presentation->wp_presentation =
+        wl_registry_bind(registry, name, &wp_presentation_interface, 1);
+    wp_presentation_add_listener(presentation->wp_presentation,
+                                 &presentation_listener, presentation);
+}
+
+void presentation_finish(struct presentation *presentation) {
+    if (presentation->wp_presentation)
+        wp_presentation_destroy(presentation->wp_presentation);
+    series_finish(&presentation->latency);
+    series_finish(&presentation->deadline_error);
+}
+
+uint64_t presentation_now(const struct presentation *presentation) {
+    struct timespec ts;
+    clock_gettime(presentation->clock_id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void feedback_handle_sync_output(void *data,
+                                        struct wp_presentation_feedback *wp,
+                                        struct wl_output *output) {
+}
+
+static void feedback_handle_presented(void *data,
+                                      struct wp_presentation_feedback *wp,
+                                      uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+                                      uint32_t tv_nsec, uint32_t refresh,
+                                      uint32_t seq_hi, uint32_t seq_lo,
+                                      uint32_t flags) {
+    struct feedback *feedback = data;
+    struct presentation *presentation = feedback->presentation;
+    uint64_t present_ns =
+        (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000u + tv_nsec;
+
+    presentation->last_present_ns = present_ns;
+    presentation->last_msc = ((uint64_t)seq_hi << 32) | seq_lo;
+    presentation->refresh_ns = refresh;
+    presentation->presented++;
+    if (feedback->measure && present_ns > feedback->submit_ns)
+        series_add(&presentation->latency, present_ns - feedback->submit_ns);
+
+    if (feedback->target_ns) {
+        uint64_t target_ns = feedback->target_ns;
+        if (present_ns > target_ns + refresh / 2)
+            presentation->deadlines_missed++;
+        else
+            presentation->deadlines_hit++;
+        if (feedback->measure)
+            series_add(&presentation->deadline_error,
+                       present_ns > target_ns ? present_ns - target_ns
+                                              : target_ns - present_ns);
+    }
+
+    wp_presentation_feedback_destroy(wp);
+    free(feedback);
+}
+
+static void feedback_handle_discarded(void *data,
+                                      struct wp_presentation_feedback *wp) {
+    struct feedback *feedback = data;
+
+    feedback->presentation->discarded++;
+    wp_presentation_feedback_destroy(wp);
+    free(feedback);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+    feedback_handle_sync_output,
+    feedback_handle_presented,
+    feedback_handle_discarded,
+};
+
+void presentation_feedback(struct presentation *presentation,
+                           struct wl_surface *surface, uint64_t submit_ns,
+                           uint64_t target_ns, bool measure) {
+    if (!presentation->wp_presentation)
+        return;
+
+    struct feedback *feedback = malloc(sizeof(*feedback));
+    assert(feedback);
+    *feedback = (struct feedback){
+        .presentation = presentation,
+        .submit_ns = submit_ns,
+        .target_ns = target_ns,
+        .measure = measure,
+    };
+    wp_presentation_feedback_add_listener(
+        wp_presentation_feedback(presentation->wp_presentation, surface),
+        &feedback_listener, feedback);
+}
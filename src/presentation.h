@@ -0,0 +1,53 @@
+#ifndef PRESENTATION_H
+#define PRESENTATION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <wayland-client.h>
+
+#include "stats.h"
+
+struct wp_presentation;
+
+// Tracks when frames actually reach the screen, using wp_presentation
+// feedback. All timestamps are on the compositor's presentation clock.
+struct presentation {
+    struct wp_presentation *wp_presentation;
+    clockid_t clock_id;
+
+    // the most recent presented frame
+    uint64_t last_present_ns;
+    uint64_t last_msc;
+    uint32_t refresh_ns; // 0 if the output has no fixed refresh rate
+
+    struct series latency; // submit to on screen
+    uint32_t presented, discarded;
+
+    // frames that were given a target presentation time
+    struct series deadline_error; // distance between target and actual
+    uint32_t deadlines_hit, deadlines_missed;
+};
+
+void presentation_bind(struct presentation *presentation,
+                       struct wl_registry *registry, uint32_t name,
+                       uint32_t version);
+void presentation_finish(struct presentation *presentation);
+
+static inline bool presentation_available(const struct presentation *p) {
+    return p->wp_presentation != NULL;
+}
+
+// Current time on the presentation clock.
+uint64_t presentation_now(const struct presentation *presentation);
+
+// Asks for feedback on the next commit of surface, which must happen after
+// the frame was submitted at submit_ns. With measure set, the frame's
+// latency is added to the series. A non-zero target_ns is the presentation
+// time the frame was scheduled for; landing more than half a refresh
+// later counts as a missed deadline.
+void presentation_feedback(struct presentation *presentation,
+                           struct wl_surface *surface, uint64_t submit_ns,
+                           uint64_t target_ns, bool measure);
+
+#endif
@@ -0,0 +1,326 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "profiler.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+// how long the writer sleeps when the ring fills slowly, which also bounds
+// how late a SIGUSR1 flush lands
+#define WRITER_PERIOD_NS 100000000u
+
+static const char *const phase_names[PHASE_COUNT] = {
+    [PHASE_ACQUIRE] = "acquire", [PHASE_FENCE_WAIT] = "fence wait",
+    [PHASE_RECORD] = "record",   [PHASE_SUBMIT] = "submit",
+    [PHASE_PRESENT] = "present",
+};
+
+static volatile sig_atomic_t dump_requested;
+
+static void handle_dump_signal(int sig) { dump_requested = 1; }
+
+static void *writer_main(void *data);
+
+static bool ends_with(const char *s, const char *suffix) {
+    size_t len = strlen(s), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+void profiler_init(struct profiler *p, VkPhysicalDevice physical_device,
+                   VkDevice device, uint32_t queue_family, const char *path) {
+    memset(p, 0, sizeof(*p));
+    p->device = device;
+    p->epoch_ns = now_ns();
+
+    if (path) {
+        p->out = fopen(path, "w");
+        if (!p->out) {
+            perror(path);
+            return;
+        }
+        p->ring.records =
+            calloc(PROFILER_RING_SIZE, sizeof(*p->ring.records));
+        assert(p->ring.records);
+        p->chrome_trace = ends_with(path, ".json");
+        p->first_event = true;
+        if (p->chrome_trace)
+            fputs("[\n", p->out);
+        else
+            fputs("frame,start_ms,acquire_ms,fence_wait_ms,record_ms,"
+                  "submit_ms,present_ms,cpu_ms,gpu_ms\n",
+                  p->out);
+    }
+    p->enabled = true;
+
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physical_device, &props);
+
+    uint32_t count;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count, NULL);
+    VkQueueFamilyProperties families[count];
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count,
+                                             families);
+    uint32_t valid_bits = families[queue_family].timestampValidBits;
+
+    if (valid_bits && props.limits.timestampPeriod > 0) {
+        p->timestamp_period = props.limits.timestampPeriod;
+        p->timestamp_mask = valid_bits >= 64 ? UINT64_MAX
+                                             : (UINT64_C(1) << valid_bits) - 1;
+        vkCreateQueryPool(device,
+                          &(VkQueryPoolCreateInfo){
+                              .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                              .queryType = VK_QUERY_TYPE_TIMESTAMP,
+                              .queryCount = 2 * PROFILER_MAX_SLOTS,
+                          },
+                          NULL, &p->query_pool);
+    } else {
+        fprintf(stderr, "GPU timestamps not supported, tracing CPU only\n");
+    }
+
+    if (!p->out)
+        return;
+    pthread_mutex_init(&p->writer_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p->writer_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_create(&p->writer, NULL, writer_main, p);
+    sigaction(SIGUSR1,
+              &(struct sigaction){
+                  .sa_handler = handle_dump_signal,
+                  .sa_flags = SA_RESTART,
+              },
+              NULL);
+}
+
+void profiler_finish(struct profiler *p) {
+    if (!p->enabled)
+        return;
+
+    // the device is idle by now, so every outstanding slot can be read back
+    for (uint32_t i = 0; i < PROFILER_MAX_SLOTS; i++)
+        profiler_collect(p, i);
+
+    if (p->out) {
+        // the writer drains what is left before it quits
+        pthread_mutex_lock(&p->writer_lock);
+        p->writer_quit = true;
+        pthread_cond_signal(&p->writer_wake);
+        pthread_mutex_unlock(&p->writer_lock);
+        pthread_join(p->writer, NULL);
+        pthread_cond_destroy(&p->writer_wake);
+        pthread_mutex_destroy(&p->writer_lock);
+    }
+
+    uint32_t dropped = atomic_load(&p->ring.dropped);
+    if (dropped)
+        fprintf(stderr, "profiler: dropped %u frames, ring was full\n",
+                dropped);
+
+    if (p->out) {
+        if (p->chrome_trace)
+            fputs("\n]\n", p->out);
+        fclose(p->out);
+    }
+    free(p->ring.records);
+    if (p->query_pool)
+        vkDestroyQueryPool(p->device, p->query_pool, NULL);
+    p->enabled = false;
+}
+
+void profiler_begin_frame(struct profiler *p) {
+    if (!p->enabled)
+        return;
+    p->current = (struct frame_record){
+        .frame = p->frame_count++,
+        .start_ns = now_ns(),
+        .pending = true,
+    };
+}
+
+void profiler_begin(struct profiler *p, enum profiler_phase phase) {
+    if (p->enabled)
+        p->current.phase_begin_ns[phase] = now_ns();
+}
+
+void profiler_end(struct profiler *p, enum profiler_phase phase) {
+    if (p->enabled)
+        p->current.phase_end_ns[phase] = now_ns();
+}
+
+void profiler_cmd_begin(struct profiler *p, VkCommandBuffer cmd,
+                        uint32_t slot) {
+    if (!p->enabled || !p->query_pool)
+        return;
+    assert(slot < PROFILER_MAX_SLOTS);
+    vkCmdResetQueryPool(cmd, p->query_pool, 2 * slot, 2);
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, p->query_pool,
+                        2 * slot);
+}
+
+void profiler_cmd_end(struct profiler *p, VkCommandBuffer cmd, uint32_t slot) {
+    if (!p->enabled || !p->query_pool)
+        return;
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        p->query_pool, 2 * slot + 1);
+}
+
+// Returns true when the push filled the ring to half, once per lap.
+static bool ring_push(struct frame_ring *ring,
+                      const struct frame_record *record) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail == PROFILER_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    ring->records[head & (PROFILER_RING_SIZE - 1)] = *record;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return head + 1 - tail == PROFILER_RING_SIZE / 2;
+}
+
+static bool ring_pop(struct frame_ring *ring, struct frame_record *record) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (tail == head)
+        return false;
+    *record = ring->records[tail & (PROFILER_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void profiler_end_frame(struct profiler *p, uint32_t slot) {
+    if (!p->enabled)
+        return;
+    assert(slot < PROFILER_MAX_SLOTS);
+    p->current.end_ns = now_ns();
+    // the GPU half of the record arrives once the slot's frame completes
+    p->slots[slot] = p->current;
+}
+
+void profiler_collect(struct profiler *p, uint32_t slot) {
+    if (!p->enabled)
+        return;
+    struct frame_record *record = &p->slots[slot];
+    if (!record->pending)
+        return;
+    record->pending = false;
+
+    uint64_t ticks[2];
+    if (p->query_pool &&
+        vkGetQueryPoolResults(p->device, p->query_pool, 2 * slot, 2,
+                              sizeof(ticks), ticks, sizeof(ticks[0]),
+                              VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+        record->gpu_begin = ticks[0] & p->timestamp_mask;
+        record->gpu_end = ticks[1] & p->timestamp_mask;
+        if (record->gpu_end >= record->gpu_begin)
+            p->last_gpu_ns = (record->gpu_end - record->gpu_begin) *
+                             p->timestamp_period;
+    }
+    if (p->out && ring_push(&p->ring, record)) {
+        pthread_mutex_lock(&p->writer_lock);
+        pthread_cond_signal(&p->writer_wake);
+        pthread_mutex_unlock(&p->writer_lock);
+    }
+}
+
+static double ms(uint64_t ns) { return ns / 1e6; }
+
+static double phase_ms(const struct frame_record *r, enum profiler_phase phase) {
+    return r->phase_begin_ns[phase]
+               ? ms(r->phase_end_ns[phase] - r->phase_begin_ns[phase])
+               : 0.0;
+}
+
+static double gpu_ms(struct profiler *p, const struct frame_record *r) {
+    if (!r->gpu_begin || r->gpu_end < r->gpu_begin)
+        return 0.0;
+    return ms((r->gpu_end - r->gpu_begin) * p->timestamp_period);
+}
+
+static void write_event(struct profiler *p, const char *name, int tid,
+                        uint64_t begin_ns, uint64_t end_ns) {
+    fprintf(p->out,
+            "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f}",
+            p->first_event ? "" : ",\n", name, tid,
+            (begin_ns - p->epoch_ns) / 1e3, (end_ns - begin_ns) / 1e3);
+    p->first_event = false;
+}
+
+static void write_chrome_record(struct profiler *p,
+                                const struct frame_record *r) {
+    write_event(p, "frame", 1, r->start_ns, r->end_ns);
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        if (r->phase_begin_ns[i])
+            write_event(p, phase_names[i], 1, r->phase_begin_ns[i],
+                        r->phase_end_ns[i]);
+    }
+
+    if (!r->gpu_begin || r->gpu_end < r->gpu_begin)
+        return;
+    // Device ticks live in their own time domain. Pin the first GPU frame to
+    // the end of its submit and keep that offset, which is good enough to
+    // see CPU and GPU overlap on one timeline.
+    int64_t begin = r->gpu_begin * p->timestamp_period;
+    int64_t end = r->gpu_end * p->timestamp_period;
+    if (!p->gpu_offset_valid) {
+        p->gpu_offset_ns = (int64_t)r->phase_end_ns[PHASE_SUBMIT] - begin;
+        p->gpu_offset_valid = true;
+    }
+    write_event(p, "render pass (GPU)", 2, begin + p->gpu_offset_ns,
+                end + p->gpu_offset_ns);
+}
+
+static void write_csv_record(struct profiler *p, const struct frame_record *r) {
+    fprintf(p->out, "%" PRIu64 ",%.3f", r->frame, ms(r->start_ns - p->epoch_ns));
+    for (int i = 0; i < PHASE_COUNT; i++)
+        fprintf(p->out, ",%.3f", phase_ms(r, i));
+    fprintf(p->out, ",%.3f,%.3f\n", ms(r->end_ns - r->start_ns),
+            gpu_ms(p, r));
+}
+
+// Drains the ring into the trace file.
+static void write_records(struct profiler *p) {
+    struct frame_record record;
+
+    while (ring_pop(&p->ring, &record)) {
+        if (p->chrome_trace)
+            write_chrome_record(p, &record);
+        else
+            write_csv_record(p, &record);
+    }
+}
+
+static void *writer_main(void *data) {
+    struct profiler *p = data;
+
+    pthread_mutex_lock(&p->writer_lock);
+    while (!p->writer_quit) {
+        pthread_mutex_unlock(&p->writer_lock);
+        write_records(p);
+        if (dump_requested) {
+            dump_requested = 0;
+            fflush(p->out);
+        }
+
+        uint64_t deadline = now_ns() + WRITER_PERIOD_NS;
+        struct timespec ts = {deadline / 1000000000u, deadline % 1000000000u};
+        pthread_mutex_lock(&p->writer_lock);
+        if (!p->writer_quit)
+            pthread_cond_timedwait(&p->writer_wake, &p->writer_lock, &ts);
+    }
+    pthread_mutex_unlock(&p->writer_lock);
+
+    write_records(p);
+    fflush(p->out);
+    return NULL;
+}
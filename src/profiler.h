@@ -0,0 +1,94 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vulkan/vulkan.h>
+
+#define PROFILER_MAX_SLOTS 8
+#define PROFILER_RING_SIZE 4096 // must be a power of two
+
+enum profiler_phase {
+    PHASE_ACQUIRE,
+    PHASE_FENCE_WAIT,
+    PHASE_RECORD,
+    PHASE_SUBMIT,
+    PHASE_PRESENT,
+    PHASE_COUNT,
+};
+
+struct frame_record {
+    uint64_t frame;
+    uint64_t start_ns, end_ns;
+    uint64_t phase_begin_ns[PHASE_COUNT];
+    uint64_t phase_end_ns[PHASE_COUNT];
+    // raw device ticks of the render pass, 0 when unavailable
+    uint64_t gpu_begin, gpu_end;
+    bool pending;
+};
+
+// Single-producer single-consumer ring: redraw() pushes finished frames, the
+// writer thread drains them. Neither side takes a lock to move records;
+// the producer only wakes the writer when the ring is half full.
+struct frame_ring {
+    struct frame_record *records; // PROFILER_RING_SIZE entries
+    _Atomic uint32_t head, tail;
+    _Atomic uint32_t dropped;
+};
+
+struct profiler {
+    bool enabled;
+    VkDevice device;
+    VkQueryPool query_pool;
+    double timestamp_period; // nanoseconds per tick
+    uint64_t timestamp_mask;
+    uint64_t epoch_ns;
+    int64_t gpu_offset_ns; // maps device time onto the CPU clock
+    bool gpu_offset_valid;
+    uint64_t last_gpu_ns; // render pass time of the latest collected frame
+
+    struct frame_record current;
+    struct frame_record slots[PROFILER_MAX_SLOTS];
+    uint64_t frame_count;
+    struct frame_ring ring;
+
+    // the trace file belongs to the writer thread while it runs
+    FILE *out;
+    bool chrome_trace;
+    bool first_event;
+
+    pthread_t writer;
+    pthread_mutex_t writer_lock;
+    pthread_cond_t writer_wake;
+    bool writer_quit;
+};
+
+// Enables the profiler and opens the trace at path. The format is chosen by
+// extension: ".json" writes a Chrome trace, anything else CSV. A writer
+// thread streams frames out as they complete, and SIGUSR1 flushes the
+// file. Without a path only the GPU time of each frame is measured, see
+// last_gpu_ns.
+void profiler_init(struct profiler *p, VkPhysicalDevice physical_device,
+                   VkDevice device, uint32_t queue_family, const char *path);
+void profiler_finish(struct profiler *p);
+
+void profiler_begin_frame(struct profiler *p);
+void profiler_end_frame(struct profiler *p, uint32_t slot);
+void profiler_begin(struct profiler *p, enum profiler_phase phase);
+void profiler_end(struct profiler *p, enum profiler_phase phase);
+
+// Record the timestamps bracketing the render passes of a frame slot, right
+// before the first begins and right after the last ends. Must be called
+// outside of a render pass.
+void profiler_cmd_begin(struct profiler *p, VkCommandBuffer cmd,
+                        uint32_t slot);
+void profiler_cmd_end(struct profiler *p, VkCommandBuffer cmd, uint32_t slot);
+
+// Reads back the GPU timestamps of the frame that last used slot. Call once
+// that frame has completed.
+void profiler_collect(struct profiler *p, uint32_t slot);
+
+#endif
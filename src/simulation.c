@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "simulation.h"
+
+#include <assert.h>
+
+#include "instance.h"
+#include "util.h"
+
+#define GROUP_SIZE 64 // local_size_x in animate.comp
+
+static uint32_t cs_spirv_source[] = {
+#include "animate.comp.spv"
+};
+
+struct push_constants {
+    uint32_t instance_count;
+    uint32_t side;
+    float cell;
+    float time;
+};
+
+void simulation_init(struct simulation *sim, VkPhysicalDevice physical_device,
+                     VkDevice device, struct allocator *allocator,
+                     VkPipelineCache pipeline_cache, VkQueue queue,
+                     uint32_t family, uint32_t graphics_family,
+                     uint32_t instance_count, uint32_t side, float cell,
+                     uint32_t slot_count) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physical_device, &props);
+    assert(slot_count <= MAX_SIMULATION_SLOTS);
+
+    *sim = (struct simulation){
+        .device = device,
+        .queue = queue,
+        .instance_count = instance_count,
+        .side = side,
+        .cell = cell,
+        .max_group_count = props.limits.maxComputeWorkGroupCount[0],
+    };
+
+    uint32_t families[] = {family, graphics_family};
+    for (uint32_t i = 0; i < 2; i++) {
+        sim->buffers[i] = create_shared_buffer(
+            allocator, (VkDeviceSize)instance_count * sizeof(struct instance),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, families,
+            family != graphics_family ? 2 : 1);
+        vkCreateSemaphore(device,
+                          &(VkSemaphoreCreateInfo){
+                              .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                          },
+                          NULL, &sim->done[i]);
+        vkCreateSemaphore(device,
+                          &(VkSemaphoreCreateInfo){
+                              .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                          },
+                          NULL, &sim->free[i]);
+    }
+
+    vkCreateCommandPool(
+        device,
+        &(const VkCommandPoolCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .queueFamilyIndex = family,
+            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        },
+        NULL, &sim->cmd_pool);
+    vkAllocateCommandBuffers(
+        device,
+        &(VkCommandBufferAllocateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = sim->cmd_pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = slot_count,
+        },
+        sim->cmd_buffers);
+
+    vkCreateDescriptorSetLayout(
+        device,
+        &(VkDescriptorSetLayoutCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .bindingCount = 1,
+            .pBindings = (VkDescriptorSetLayoutBinding[]){{
+                .binding = 0,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .descriptorCount = 1,
+                .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            }},
+        },
+        NULL, &sim->set_layout);
+
+    vkCreatePipelineLayout(
+        device,
+        &(VkPipelineLayoutCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount = 1,
+            .pSetLayouts = &sim->set_layout,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges =
+                &(VkPushConstantRange){
+                    .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .size = sizeof(struct push_constants),
+                },
+        },
+        NULL, &sim->pipeline_layout);
+
+    VkShaderModule cs_module;
+    vkCreateShaderModule(
+        device,
+        &(VkShaderModuleCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+            .codeSize = sizeof(cs_spirv_source),
+            .pCode = cs_spirv_source,
+        },
+        NULL, &cs_module);
+
+    vkCreateComputePipelines(
+        device, pipeline_cache, 1,
+        &(VkComputePipelineCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage =
+                {
+                    .sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .module = cs_module,
+                    .pName = "main",
+                },
+            .layout = sim->pipeline_layout,
+        },
+        NULL, &sim->pipeline);
+    vkDestroyShaderModule(device, cs_module, NULL);
+
+    vkCreateDescriptorPool(
+        device,
+        &(VkDescriptorPoolCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .maxSets = 2,
+            .poolSizeCount = 1,
+            .pPoolSizes = (VkDescriptorPoolSize[]){{
+                .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .descriptorCount = 2,
+            }},
+        },
+        NULL, &sim->desc_pool);
+
+    vkAllocateDescriptorSets(
+        device,
+        &(VkDescriptorSetAllocateInfo){
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = sim->desc_pool,
+            .descriptorSetCount = 2,
+            .pSetLayouts = (VkDescriptorSetLayout[]){sim->set_layout,
+                                                     sim->set_layout},
+        },
+        sim->desc_sets);
+
+    for (uint32_t i = 0; i < 2; i++)
+        vkUpdateDescriptorSets(
+            device, 1,
+            &(VkWriteDescriptorSet){
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = sim->desc_sets[i],
+                .dstBinding = 0,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &(VkDescriptorBufferInfo){
+                    sim->buffers[i].buffer, 0, VK_WHOLE_SIZE},
+            },
+            0, NULL);
+}
+
+void simulation_finish(struct simulation *sim, struct allocator *allocator) {
+    if (!sim->device)
+        return;
+    vkDestroyPipeline(sim->device, sim->pipeline, NULL);
+    vkDestroyPipelineLayout(sim->device, sim->pipeline_layout, NULL);
+    vkDestroyDescriptorPool(sim->device, sim->desc_pool, NULL);
+    vkDestroyDescriptorSetLayout(sim->device, sim->set_layout, NULL);
+    vkDestroyCommandPool(sim->device, sim->cmd_pool, NULL);
+    for (uint32_t i = 0; i < 2; i++) {
+        vkDestroySemaphore(sim->device, sim->done[i], NULL);
+        vkDestroySemaphore(sim->device, sim->free[i], NULL);
+        destroy_buffer(allocator, &sim->buffers[i]);
+    }
+}
+
+void simulation_step(struct simulation *sim, uint32_t slot, float time) {
+    uint32_t index = sim->step % 2;
+    VkCommandBuffer cmd = sim->cmd_buffers[slot];
+
+    vkBeginCommandBuffer(
+        cmd, &(VkCommandBufferBeginInfo){
+                 .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                 .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+             });
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, sim->pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            sim->pipeline_layout, 0, 1,
+                            &sim->desc_sets[index], 0, NULL);
+    vkCmdPushConstants(cmd, sim->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
+                       0, sizeof(struct push_constants),
+                       &(struct push_constants){
+                           .instance_count = sim->instance_count,
+                           .side = sim->side,
+                           .cell = sim->cell,
+                           .time = time,
+                       });
+    uint32_t groups = (sim->instance_count + GROUP_SIZE - 1) / GROUP_SIZE;
+    uint32_t groups_x = MIN(groups, sim->max_group_count);
+    vkCmdDispatch(cmd, groups_x, (groups + groups_x - 1) / groups_x, 1);
+    vkEndCommandBuffer(cmd);
+
+    // the first use of each buffer has no earlier frame to wait for
+    bool wait = sim->step >= 2;
+    vkQueueSubmit(sim->queue, 1,
+                  &(VkSubmitInfo){
+                      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                      .waitSemaphoreCount = wait ? 1 : 0,
+                      .pWaitSemaphores = &sim->free[index],
+                      .pWaitDstStageMask =
+                          (VkPipelineStageFlags[]){
+                              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                          },
+                      .commandBufferCount = 1,
+                      .pCommandBuffers = &cmd,
+                      .signalSemaphoreCount = 1,
+                      .pSignalSemaphores = &sim->done[index],
+                  },
+                  VK_NULL_HANDLE);
+    sim->step++;
+}
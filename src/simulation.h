@@ -0,0 +1,63 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "memory.h"
+
+#define MAX_SIMULATION_SLOTS 8
+
+// Animates the instances with a compute shader on its own queue, ideally
+// from a compute-only family, so the work overlaps with rasterization.
+// Step k writes buffer k % 2 while the graphics queue may still read the
+// other one:
+//   compute k:  waits free[k % 2] (k >= 2), signals done[k % 2]
+//   graphics k: waits done[k % 2], signals free[k % 2]
+struct simulation {
+    VkDevice device;
+    VkQueue queue;
+    VkCommandPool cmd_pool;
+    VkCommandBuffer cmd_buffers[MAX_SIMULATION_SLOTS];
+    VkDescriptorSetLayout set_layout;
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+    VkDescriptorPool desc_pool;
+    VkDescriptorSet desc_sets[2];
+
+    struct buffer buffers[2]; // struct instance layout, vertex binding 1
+    VkSemaphore done[2], free[2];
+    uint64_t step; // steps submitted so far
+
+    uint32_t instance_count, side;
+    float cell;
+    uint32_t max_group_count;
+};
+
+// The buffers are shared between family and graphics_family without
+// ownership transfers. slot_count command buffers are used round-robin;
+// slot s may be reused once the graphics frame of the step that last used
+// it has completed.
+void simulation_init(struct simulation *sim, VkPhysicalDevice physical_device,
+                     VkDevice device, struct allocator *allocator,
+                     VkPipelineCache pipeline_cache, VkQueue queue,
+                     uint32_t family, uint32_t graphics_family,
+                     uint32_t instance_count, uint32_t side, float cell,
+                     uint32_t slot_count);
+void simulation_finish(struct simulation *sim, struct allocator *allocator);
+
+// Submits the next step, animated to time seconds.
+void simulation_step(struct simulation *sim, uint32_t slot, float time);
+
+// What the graphics submit of the latest step reads, waits on and signals.
+static inline VkBuffer simulation_buffer(const struct simulation *sim) {
+    return sim->buffers[(sim->step - 1) % 2].buffer;
+}
+static inline VkSemaphore simulation_done(const struct simulation *sim) {
+    return sim->done[(sim->step - 1) % 2];
+}
+static inline VkSemaphore simulation_free(const struct simulation *sim) {
+    return sim->free[(sim->step - 1) % 2];
+}
+
+#endif
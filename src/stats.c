@@ -0,0 +1,54 @@
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+void series_add(struct series *series, uint64_t sample_ns) {
+    if (series->count == series->capacity) {
+        series->capacity = series->capacity ? 2 * series->capacity : 1024;
+        series->samples = realloc(series->samples,
+                                  series->capacity * sizeof(*series->samples));
+        assert(series->samples);
+    }
+    series->samples[series->count++] = sample_ns;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of sorted samples
+static double percentile(const uint64_t *sorted, size_t count, double p) {
+    size_t rank = (size_t)(p / 100.0 * count + 0.5);
+    rank = rank ? rank - 1 : 0;
+    return sorted[rank < count ? rank : count - 1] / 1e6;
+}
+
+void series_summarize(const struct series *series, struct summary *summary) {
+    memset(summary, 0, sizeof(*summary));
+    summary->count = series->count;
+    if (!series->count)
+        return;
+
+    uint64_t *sorted = malloc(series->count * sizeof(*sorted));
+    assert(sorted);
+    memcpy(sorted, series->samples, series->count * sizeof(*sorted));
+    qsort(sorted, series->count, sizeof(*sorted), compare_u64);
+
+    double sum = 0;
+    for (size_t i = 0; i < series->count; i++)
+        sum += sorted[i];
+    summary->mean = sum / series->count / 1e6;
+    summary->p50 = percentile(sorted, series->count, 50);
+    summary->p95 = percentile(sorted, series->count, 95);
+    summary->p99 = percentile(sorted, series->count, 99);
+    summary->max = sorted[series->count - 1] / 1e6;
+    free(sorted);
+}
+
+void series_finish(struct series *series) {
+    free(series->samples);
+    memset(series, 0, sizeof(*series));
+}
@@ -0,0 +1,22 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A growing series of samples, e.g. frame times, in nanoseconds.
+struct series {
+    uint64_t *samples;
+    size_t count, capacity;
+};
+
+struct summary {
+    size_t count;
+    double mean, p50, p95, p99, max; // milliseconds
+};
+
+void series_add(struct series *series, uint64_t sample_ns);
+void series_summarize(const struct series *series, struct summary *summary);
+void series_finish(struct series *series);
+
+#endif
@@ -0,0 +1,176 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "sync.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+enum retired_type {
+    RETIRED_BUFFER,
+    RETIRED_IMAGE,
+    RETIRED_FRAMEBUFFER,
+    RETIRED_SWAPCHAIN,
+};
+
+struct retired {
+    uint64_t value; // of the last submit using the resource
+    enum retired_type type;
+    union {
+        struct buffer buffer;
+        struct {
+            VkImage image;
+            VkImageView view;
+            struct allocation alloc;
+        } image;
+        VkFramebuffer framebuffer;
+        VkSwapchainKHR swapchain;
+    };
+    struct retired *next;
+};
+
+void sync_init(struct sync *sync, VkDevice device,
+               struct allocator *allocator) {
+    memset(sync, 0, sizeof(*sync));
+    sync->device = device;
+    sync->allocator = allocator;
+
+    vkCreateSemaphore(
+        device,
+        &(VkSemaphoreCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext =
+                &(VkSemaphoreTypeCreateInfo){
+                    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+                    .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+                    .initialValue = 0,
+                },
+        },
+        NULL, &sync->timeline);
+    assert(sync->timeline);
+}
+
+static void destroy_retired(struct sync *sync, struct retired *retired) {
+    VkDevice device = sync->device;
+
+    switch (retired->type) {
+    case RETIRED_BUFFER:
+        destroy_buffer(sync->allocator, &retired->buffer);
+        break;
+    case RETIRED_IMAGE:
+        if (retired->image.view)
+            vkDestroyImageView(device, retired->image.view, NULL);
+        if (retired->image.image)
+            vkDestroyImage(device, retired->image.image, NULL);
+        if (retired->image.alloc.memory)
+            mem_free(sync->allocator, &retired->image.alloc);
+        break;
+    case RETIRED_FRAMEBUFFER:
+        vkDestroyFramebuffer(device, retired->framebuffer, NULL);
+        break;
+    case RETIRED_SWAPCHAIN:
+        vkDestroySwapchainKHR(device, retired->swapchain, NULL);
+        break;
+    }
+    free(retired);
+}
+
+void sync_finish(struct sync *sync) {
+    assert(sync_reached(sync, sync->submitted));
+    sync_collect(sync);
+    assert(!sync->retired);
+    vkDestroySemaphore(sync->device, sync->timeline, NULL);
+}
+
+uint64_t sync_next_value(struct sync *sync) {
+    return ++sync->submitted;
+}
+
+bool sync_reached(struct sync *sync, uint64_t value) {
+    assert(value <= sync->submitted);
+    if (value <= sync->completed)
+        return true;
+    uint64_t completed;
+    vkGetSemaphoreCounterValue(sync->device, sync->timeline, &completed);
+    sync->completed = MAX(sync->completed, completed);
+    return value <= sync->completed;
+}
+
+void sync_wait(struct sync *sync, uint64_t value) {
+    if (sync_reached(sync, value))
+        return;
+    vkWaitSemaphores(sync->device,
+                     &(VkSemaphoreWaitInfo){
+                         .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+                         .semaphoreCount = 1,
+                         .pSemaphores = &sync->timeline,
+                         .pValues = &value,
+                     },
+                     UINT64_MAX);
+    sync->completed = value;
+}
+
+void sync_wait_idle(struct sync *sync) {
+    sync_wait(sync, sync->submitted);
+    sync_collect(sync);
+}
+
+static struct retired *retire(struct sync *sync, uint64_t value,
+                              enum retired_type type) {
+    assert(value <= sync->submitted);
+    struct retired *retired = calloc(1, sizeof(*retired));
+    assert(retired);
+    retired->value = value;
+    retired->type = type;
+    retired->next = sync->retired;
+    sync->retired = retired;
+    sync->retired_count++;
+    return retired;
+}
+
+void sync_retire_buffer(struct sync *sync, uint64_t value,
+                        struct buffer *buffer) {
+    retire(sync, value, RETIRED_BUFFER)->buffer = *buffer;
+    *buffer = (struct buffer){0};
+}
+
+void sync_retire_image(struct sync *sync, uint64_t value, VkImage image,
+                       VkImageView view, struct allocation *alloc) {
+    struct retired *retired = retire(sync, value, RETIRED_IMAGE);
+    retired->image.image = image;
+    retired->image.view = view;
+    if (alloc) {
+        retired->image.alloc = *alloc;
+        *alloc = (struct allocation){0};
+    }
+}
+
+void sync_retire_framebuffer(struct sync *sync, uint64_t value,
+                             VkFramebuffer framebuffer) {
+    retire(sync, value, RETIRED_FRAMEBUFFER)->framebuffer = framebuffer;
+}
+
+void sync_retire_swapchain(struct sync *sync, uint64_t value,
+                           VkSwapchainKHR swapchain) {
+    retire(sync, value, RETIRED_SWAPCHAIN)->swapchain = swapchain;
+}
+
+void sync_collect(struct sync *sync) {
+    if (!sync->retired)
+        return;
+    // one query covers the whole list
+    sync_reached(sync, sync->submitted);
+
+    struct retired *retired;
+    for (struct retired **link = &sync->retired; (retired = *link);) {
+        if (retired->value <= sync->completed) {
+            *link = retired->next;
+            sync->retired_count--;
+            destroy_retired(sync, retired);
+        } else {
+            link = &retired->next;
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "memory.h"
+
+struct retired;
+
+// Progress of the graphics queue as one timeline semaphore. Every submit the
+// host needs to know about signals the next value, so a single number names
+// a point in the queue: a frame, an upload batch, the last use of an image.
+// Values reach the queue in increasing order, and reaching one means all
+// earlier ones were reached as well.
+struct sync {
+    VkDevice device;
+    struct allocator *allocator;
+    VkSemaphore timeline;
+    uint64_t submitted; // last value handed out
+    uint64_t completed; // last value seen reached, may lag behind
+
+    // resources waiting for their last use to complete, in no order
+    struct retired *retired;
+    uint32_t retired_count;
+};
+
+void sync_init(struct sync *sync, VkDevice device,
+               struct allocator *allocator);
+// Destroys the semaphore and whatever is still retired, so everything
+// submitted must have completed, see sync_wait_idle().
+void sync_finish(struct sync *sync);
+
+// Returns the value for the next submit to signal. Call right before the
+// submit so that the values reach the queue in order.
+uint64_t sync_next_value(struct sync *sync);
+
+// Whether value has been reached, without blocking.
+bool sync_reached(struct sync *sync, uint64_t value);
+// Blocks until value is reached. 0 is reached from the start.
+void sync_wait(struct sync *sync, uint64_t value);
+// Blocks until everything submitted has completed, and collects.
+void sync_wait_idle(struct sync *sync);
+
+// Deferred destruction: once value is reached, sync_collect() destroys the
+// resource and frees its memory. Null handles are skipped, so an image
+// without a view or a view of a swapchain image can be retired as well.
+void sync_retire_buffer(struct sync *sync, uint64_t value,
+                        struct buffer *buffer);
+void sync_retire_image(struct sync *sync, uint64_t value, VkImage image,
+                       VkImageView view, struct allocation *alloc);
+void sync_retire_framebuffer(struct sync *sync, uint64_t value,
+                             VkFramebuffer framebuffer);
+void sync_retire_swapchain(struct sync *sync, uint64_t value,
+                           VkSwapchainKHR swapchain);
+
+// Destroys what was retired up to the last reached value. Never blocks.
+void sync_collect(struct sync *sync);
+
+#endif
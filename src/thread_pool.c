@@ -0,0 +1,95 @@
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+static void *worker_main(void *arg) {
+    struct thread_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->next_job == pool->job_count)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        if (pool->quit)
+            break;
+
+        uint32_t job = pool->next_job++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->fn(pool->data, job);
+        pthread_mutex_lock(&pool->lock);
+
+        if (++pool->jobs_done == pool->job_count)
+            pthread_cond_signal(&pool->work_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+void thread_pool_init(struct thread_pool *pool, uint32_t thread_count) {
+    *pool = (struct thread_pool){
+        .thread_count = thread_count,
+    };
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    pool->threads = calloc(thread_count, sizeof(*pool->threads));
+    assert(pool->threads);
+    for (uint32_t i = 0; i < thread_count; i++) {
+        int ret = pthread_create(&pool->threads[i], NULL, worker_main, pool);
+        assert(ret == 0);
+        (void)ret;
+    }
+}
+
+void thread_pool_finish(struct thread_pool *pool) {
+    if (!pool->threads)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    pool->threads = NULL;
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+void thread_pool_start(struct thread_pool *pool, thread_pool_fn fn,
+                       void *data, uint32_t count) {
+    pthread_mutex_lock(&pool->lock);
+    assert(pool->jobs_done == pool->job_count);
+    pool->fn = fn;
+    pool->data = data;
+    pool->next_job = 0;
+    pool->jobs_done = 0;
+    pool->job_count = count;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(struct thread_pool *pool) {
+    if (!pool->threads)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->jobs_done != pool->job_count)
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_run(struct thread_pool *pool, thread_pool_fn fn, void *data,
+                     uint32_t count) {
+    if (!count)
+        return;
+
+    thread_pool_start(pool, fn, data, count);
+    thread_pool_wait(pool);
+}
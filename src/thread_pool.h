@@ -0,0 +1,40 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Runs job i of a batch as fn(data, i). Every job runs exactly once, on
+// whichever worker picks it up first.
+typedef void (*thread_pool_fn)(void *data, uint32_t job);
+
+// A fixed set of worker threads for batches of jobs. The caller either
+// blocks until the batch has finished (fork-join) or starts it and comes
+// back for it later. One batch at a time.
+struct thread_pool {
+    pthread_t *threads;
+    uint32_t thread_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready, work_done;
+    thread_pool_fn fn;
+    void *data;
+    uint32_t next_job, job_count, jobs_done;
+    bool quit;
+};
+
+void thread_pool_init(struct thread_pool *pool, uint32_t thread_count);
+void thread_pool_finish(struct thread_pool *pool);
+
+// Runs jobs 0 to count - 1 on the workers and returns once all are done.
+void thread_pool_run(struct thread_pool *pool, thread_pool_fn fn, void *data,
+                     uint32_t count);
+
+// Hands out jobs 0 to count - 1 and returns right away. The batch must be
+// waited for before the next one or thread_pool_finish().
+void thread_pool_start(struct thread_pool *pool, thread_pool_fn fn,
+                       void *data, uint32_t count);
+void thread_pool_wait(struct thread_pool *pool);
+
+#endif
@@ -0,0 +1,353 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "upload.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define STAGING_ALIGNMENT 16
+
+void uploader_init(struct uploader *uploader, struct allocator *allocator,
+                   struct sync *sync, VkQueue transfer_queue,
+                   uint32_t transfer_family, VkQueue graphics_queue,
+                   uint32_t graphics_family) {
+    VkDevice device = allocator->device;
+
+    memset(uploader, 0, sizeof(*uploader));
+    uploader->device = device;
+    uploader->allocator = allocator;
+    uploader->sync = sync;
+    uploader->transfer_queue = transfer_queue;
+    uploader->transfer_family = transfer_family;
+    uploader->graphics_queue = graphics_queue;
+    uploader->graphics_family = graphics_family;
+
+    // staging memory is only ever written by the CPU, so it does not ask
+    // for DEVICE_LOCAL and stays out of the small device-local window of
+    // host-visible memory, see allocator_find_type()
+    uploader->ring = create_buffer(allocator, UPLOAD_RING_SIZE,
+                                   VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                   0);
+
+    vkCreateCommandPool(
+        device,
+        &(VkCommandPoolCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                     VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = transfer_family,
+        },
+        NULL, &uploader->transfer_pool);
+    vkCreateCommandPool(
+        device,
+        &(VkCommandPoolCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                     VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = graphics_family,
+        },
+        NULL, &uploader->graphics_pool);
+
+    for (uint32_t i = 0; i < NUM_UPLOAD_BATCHES; i++) {
+        struct upload_batch *batch = &uploader->batches[i];
+
+        vkAllocateCommandBuffers(
+            device,
+            &(VkCommandBufferAllocateInfo){
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .commandPool = uploader->transfer_pool,
+                .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                .commandBufferCount = 1,
+            },
+            &batch->transfer_cmd);
+
+        if (transfer_family == graphics_family)
+            continue;
+
+        vkAllocateCommandBuffers(
+            device,
+            &(VkCommandBufferAllocateInfo){
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .commandPool = uploader->graphics_pool,
+                .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                .commandBufferCount = 1,
+            },
+            &batch->graphics_cmd);
+        vkCreateSemaphore(device,
+                          &(VkSemaphoreCreateInfo){
+                              .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                          },
+                          NULL, &batch->semaphore);
+    }
+}
+
+static void retire_batch(struct uploader *uploader,
+                         struct upload_batch *batch) {
+    batch->in_flight = false;
+    uploader->tail = batch->ring_end;
+    uploader->used -= batch->ring_bytes;
+    uploader->oldest_batch = (uploader->oldest_batch + 1) % NUM_UPLOAD_BATCHES;
+}
+
+// Blocks until the oldest batch is done. Returns false if nothing is in
+// flight.
+static bool wait_oldest_batch(struct uploader *uploader) {
+    struct upload_batch *batch = &uploader->batches[uploader->oldest_batch];
+    if (!batch->in_flight)
+        return false;
+    sync_wait(uploader->sync, batch->value);
+    retire_batch(uploader, batch);
+    return true;
+}
+
+void upload_collect(struct uploader *uploader) {
+    for (;;) {
+        struct upload_batch *batch =
+            &uploader->batches[uploader->oldest_batch];
+        if (!batch->in_flight || !sync_reached(uploader->sync, batch->value))
+            break;
+        retire_batch(uploader, batch);
+    }
+}
+
+void uploader_finish(struct uploader *uploader) {
+    upload_flush(uploader);
+    while (wait_oldest_batch(uploader))
+        ;
+
+    for (uint32_t i = 0; i < NUM_UPLOAD_BATCHES; i++)
+        if (uploader->batches[i].semaphore)
+            vkDestroySemaphore(uploader->device, uploader->batches[i].semaphore,
+                               NULL);
+    vkDestroyCommandPool(uploader->device, uploader->transfer_pool, NULL);
+    vkDestroyCommandPool(uploader->device, uploader->graphics_pool, NULL);
+    destroy_buffer(uploader->allocator, &uploader->ring);
+    free(uploader->copies);
+}
+
+// Carves size bytes out of the ring, or fails if they are still in use.
+static bool ring_alloc(struct uploader *uploader, VkDeviceSize size,
+                       VkDeviceSize *offset) {
+    VkDeviceSize ring_size = uploader->ring.size;
+
+    if (!uploader->used)
+        uploader->head = uploader->tail = 0;
+
+    if (!uploader->used || uploader->head > uploader->tail) {
+        if (ring_size - uploader->head >= size) {
+            *offset = uploader->head;
+        } else if (uploader->tail >= size) {
+            // wrap around, the end of the ring stays unused for this lap
+            uploader->used += ring_size - uploader->head;
+            uploader->pending_bytes += ring_size - uploader->head;
+            *offset = 0;
+        } else {
+            return false;
+        }
+    } else if (uploader->tail - uploader->head >= size) {
+        *offset = uploader->head;
+    } else {
+        return false;
+    }
+
+    uploader->head = *offset + size;
+    uploader->used += size;
+    uploader->pending_bytes += size;
+    return true;
+}
+
+void *upload_reserve(struct uploader *uploader, VkBuffer dst,
+                     VkDeviceSize dst_offset, VkDeviceSize size) {
+    VkDeviceSize aligned = ALIGN_UP(size, STAGING_ALIGNMENT);
+    VkDeviceSize offset;
+
+    assert(aligned <= uploader->ring.size / 2);
+    while (!ring_alloc(uploader, aligned, &offset)) {
+        // make room by retiring old batches, submitting our own if needed
+        upload_collect(uploader);
+        if (ring_alloc(uploader, aligned, &offset))
+            break;
+        if (uploader->copy_count)
+            upload_flush(uploader);
+        bool waited = wait_oldest_batch(uploader);
+        assert(waited);
+    }
+
+    if (uploader->copy_count == uploader->copy_capacity) {
+        uploader->copy_capacity =
+            uploader->copy_capacity ? 2 * uploader->copy_capacity : 64;
+        uploader->copies =
+            realloc(uploader->copies,
+                    uploader->copy_capacity * sizeof(*uploader->copies));
+        assert(uploader->copies);
+    }
+    uploader->copies[uploader->copy_count++] = (struct upload_copy){
+        .dst = dst,
+        .src_offset = offset,
+        .dst_offset = dst_offset,
+        .size = size,
+    };
+
+    return (char *)uploader->ring.map + offset;
+}
+
+void upload_buffer(struct uploader *uploader, VkBuffer dst,
+                   VkDeviceSize dst_offset, const void *data,
+                   VkDeviceSize size) {
+    const VkDeviceSize chunk_size = UPLOAD_RING_SIZE / 4;
+
+    for (VkDeviceSize done = 0; done < size;) {
+        VkDeviceSize n = MIN(size - done, chunk_size);
+        memcpy(upload_reserve(uploader, dst, dst_offset + done, n),
+               (const char *)data + done, n);
+        done += n;
+    }
+}
+
+static void record_copies(struct uploader *uploader, VkCommandBuffer cmd,
+                          bool release) {
+    VkBufferMemoryBarrier barriers[uploader->copy_count];
+
+    vkBeginCommandBuffer(
+        cmd, &(VkCommandBufferBeginInfo){
+                 .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                 .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+             });
+
+    for (uint32_t i = 0; i < uploader->copy_count; i++) {
+        const struct upload_copy *copy = &uploader->copies[i];
+
+        vkCmdCopyBuffer(cmd, uploader->ring.buffer, copy->dst, 1,
+                        &(VkBufferCopy){
+                            .srcOffset = copy->src_offset,
+                            .dstOffset = copy->dst_offset,
+                            .size = copy->size,
+                        });
+        barriers[i] = (VkBufferMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = release ? 0 : VK_ACCESS_MEMORY_READ_BIT,
+            .srcQueueFamilyIndex =
+                release ? uploader->transfer_family : VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex =
+                release ? uploader->graphics_family : VK_QUEUE_FAMILY_IGNORED,
+            .buffer = copy->dst,
+            .offset = copy->dst_offset,
+            .size = copy->size,
+        };
+    }
+
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         release ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+                                 : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         0, 0, NULL, uploader->copy_count, barriers, 0, NULL);
+    vkEndCommandBuffer(cmd);
+}
+
+// The acquire half of the queue family ownership transfer.
+static void record_acquire(struct uploader *uploader, VkCommandBuffer cmd) {
+    VkBufferMemoryBarrier barriers[uploader->copy_count];
+
+    vkBeginCommandBuffer(
+        cmd, &(VkCommandBufferBeginInfo){
+                 .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                 .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+             });
+
+    for (uint32_t i = 0; i < uploader->copy_count; i++) {
+        const struct upload_copy *copy = &uploader->copies[i];
+
+        barriers[i] = (VkBufferMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = 0,
+            .dstAccessMask = VK_ACCESS_MEMORY_READ_BIT,
+            .srcQueueFamilyIndex = uploader->transfer_family,
+            .dstQueueFamilyIndex = uploader->graphics_family,
+            .buffer = copy->dst,
+            .offset = copy->dst_offset,
+            .size = copy->size,
+        };
+    }
+
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, NULL,
+                         uploader->copy_count, barriers, 0, NULL);
+    vkEndCommandBuffer(cmd);
+}
+
+void upload_flush(struct uploader *uploader) {
+    if (!uploader->copy_count)
+        return;
+
+    struct upload_batch *batch = &uploader->batches[uploader->next_batch];
+    if (batch->in_flight) {
+        // all batch slots are busy, the slot we need is the oldest one
+        bool waited = wait_oldest_batch(uploader);
+        assert(waited);
+    }
+
+    bool dedicated = uploader->transfer_family != uploader->graphics_family;
+    vkResetCommandBuffer(batch->transfer_cmd, 0);
+    record_copies(uploader, batch->transfer_cmd, dedicated);
+
+    // whichever submit reaches the graphics queue signals the batch's value
+    batch->value = sync_next_value(uploader->sync);
+    VkTimelineSemaphoreSubmitInfo timeline_info = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &batch->value,
+    };
+    if (!dedicated) {
+        vkQueueSubmit(uploader->graphics_queue, 1,
+                      &(VkSubmitInfo){
+                          .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                          .pNext = &timeline_info,
+                          .commandBufferCount = 1,
+                          .pCommandBuffers = &batch->transfer_cmd,
+                          .signalSemaphoreCount = 1,
+                          .pSignalSemaphores = &uploader->sync->timeline,
+                      },
+                      VK_NULL_HANDLE);
+    } else {
+        vkResetCommandBuffer(batch->graphics_cmd, 0);
+        record_acquire(uploader, batch->graphics_cmd);
+
+        vkQueueSubmit(uploader->transfer_queue, 1,
+                      &(VkSubmitInfo){
+                          .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                          .commandBufferCount = 1,
+                          .pCommandBuffers = &batch->transfer_cmd,
+                          .signalSemaphoreCount = 1,
+                          .pSignalSemaphores = &batch->semaphore,
+                      },
+                      VK_NULL_HANDLE);
+        vkQueueSubmit(uploader->graphics_queue, 1,
+                      &(VkSubmitInfo){
+                          .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                          .pNext = &timeline_info,
+                          .waitSemaphoreCount = 1,
+                          .pWaitSemaphores = &batch->semaphore,
+                          .pWaitDstStageMask =
+                              (VkPipelineStageFlags[]){
+                                  VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                              },
+                          .commandBufferCount = 1,
+                          .pCommandBuffers = &batch->graphics_cmd,
+                          .signalSemaphoreCount = 1,
+                          .pSignalSemaphores = &uploader->sync->timeline,
+                      },
+                      VK_NULL_HANDLE);
+    }
+
+    batch->in_flight = true;
+    batch->ring_end = uploader->head;
+    batch->ring_bytes = uploader->pending_bytes;
+    uploader->pending_bytes = 0;
+    uploader->copy_count = 0;
+    uploader->next_batch = (uploader->next_batch + 1) % NUM_UPLOAD_BATCHES;
+}
@@ -0,0 +1,76 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include "memory.h"
+#include "sync.h"
+
+#define UPLOAD_RING_SIZE (16u << 20)
+#define NUM_UPLOAD_BATCHES 4
+
+struct upload_copy {
+    VkBuffer dst;
+    VkDeviceSize src_offset, dst_offset, size;
+};
+
+// One submit worth of copies. With a dedicated transfer queue the copies run
+// there and end with a queue family release; the matching acquire is
+// submitted to the graphics queue, which signals the timeline value.
+struct upload_batch {
+    VkCommandBuffer transfer_cmd, graphics_cmd;
+    VkSemaphore semaphore;
+    uint64_t value;
+    VkDeviceSize ring_end, ring_bytes;
+    bool in_flight;
+};
+
+struct uploader {
+    VkDevice device;
+    struct allocator *allocator;
+    struct sync *sync;
+    VkQueue transfer_queue, graphics_queue;
+    uint32_t transfer_family, graphics_family;
+    VkCommandPool transfer_pool, graphics_pool;
+
+    // persistently mapped staging ring, data lives in [tail, head)
+    struct buffer ring;
+    VkDeviceSize head, tail, used;
+
+    struct upload_copy *copies;
+    uint32_t copy_count, copy_capacity;
+    VkDeviceSize pending_bytes;
+
+    struct upload_batch batches[NUM_UPLOAD_BATCHES];
+    uint32_t next_batch, oldest_batch;
+};
+
+void uploader_init(struct uploader *uploader, struct allocator *allocator,
+                   struct sync *sync, VkQueue transfer_queue,
+                   uint32_t transfer_family, VkQueue graphics_queue,
+                   uint32_t graphics_family);
+void uploader_finish(struct uploader *uploader);
+
+// Returns staging memory for size bytes that will be copied to dst at
+// dst_offset by the next flush. Callers write straight into it, which saves
+// an intermediate copy. size must not exceed UPLOAD_RING_SIZE / 2.
+// Making room may flush the copies queued so far, so a reservation has to
+// be filled before the next one is made, and is not to be read back.
+void *upload_reserve(struct uploader *uploader, VkBuffer dst,
+                     VkDeviceSize dst_offset, VkDeviceSize size);
+
+// Copies data into staging memory and queues it for dst. Large uploads are
+// split, flushing as often as the ring requires.
+void upload_buffer(struct uploader *uploader, VkBuffer dst,
+                   VkDeviceSize dst_offset, const void *data, VkDeviceSize size);
+
+// Submits all queued copies at once. Anything submitted to the graphics
+// queue afterwards sees the uploaded data.
+void upload_flush(struct uploader *uploader);
+
+// Retires finished batches without blocking.
+void upload_collect(struct uploader *uploader);
+
+#endif
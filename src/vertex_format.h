@@ -0,0 +1,94 @@
+#ifndef VERTEX_FORMAT_H
+#define VERTEX_FORMAT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mesh_format.h"
+#include "vertex_config.h" // VERTEX_FORMAT{,_NAME} from meson_options.txt
+
+// One row per vertex layout: name, enum mesh_vertex_format value, stride,
+// position and color attribute format without the VK_FORMAT_ prefix, and
+// color offset. The pipeline's attribute descriptions and pack_vertex()
+// both follow this table. triangle.vert reads both attributes as vec4,
+// which Vulkan fills from any float or normalized format, so the shader
+// needs no variants.
+#define VERTEX_FORMATS(X)                                                      \
+    X(float32, MESH_VERTEX_FLOAT32, 24, R32G32B32_SFLOAT, R32G32B32_SFLOAT, 12) \
+    X(half, MESH_VERTEX_HALF, 12, R16G16B16A16_SFLOAT, R8G8B8A8_UNORM, 8)      \
+    X(snorm16, MESH_VERTEX_SNORM16, 12, R16G16B16A16_SNORM, R8G8B8A8_UNORM, 8)
+
+struct vertex_layout {
+    const char *name;
+    uint32_t stride, color_offset;
+};
+
+#define VERTEX_LAYOUT(name, format, stride, position, color, color_offset)     \
+    [format] = {#name, stride, color_offset},
+static const struct vertex_layout vertex_layouts[] = {
+    VERTEX_FORMATS(VERTEX_LAYOUT)};
+#undef VERTEX_LAYOUT
+
+#define VERTEX_STRIDE (vertex_layouts[VERTEX_FORMAT].stride)
+
+// Round to nearest even, out of range values become infinity.
+static inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+
+    if (abs > 0x7f800000) // NaN
+        return sign | 0x7e00;
+    if (abs >= 0x477ff000) // rounds to 65536 or more
+        return sign | 0x7c00;
+    if (abs < 0x38800000) { // below the smallest normal half
+        float v;
+        memcpy(&v, &abs, sizeof(v));
+        return sign | (uint16_t)lrintf(v * 16777216.0f); // v / 2^-24
+    }
+    uint32_t h = (abs - 0x38000000) >> 13; // rebias the exponent 127 -> 15
+    uint32_t rest = abs & 0x1fff;
+    h += rest > 0x1000 || (rest == 0x1000 && (h & 1));
+    return sign | h;
+}
+
+static inline int16_t float_to_snorm16(float f) {
+    return lrintf(fminf(fmaxf(f, -1.0f), 1.0f) * 32767.0f);
+}
+
+static inline uint8_t float_to_unorm8(float f) {
+    return lrintf(fminf(fmaxf(f, 0.0f), 1.0f) * 255.0f);
+}
+
+// Writes one vertex of the given layout, vertex_layouts[format].stride
+// bytes, to out.
+static inline void pack_vertex(enum mesh_vertex_format format,
+                               const float position[3], const float color[3],
+                               void *out) {
+    uint8_t *p = out;
+
+    if (format == MESH_VERTEX_FLOAT32) {
+        memcpy(p, position, 3 * sizeof(float));
+        memcpy(p + 3 * sizeof(float), color, 3 * sizeof(float));
+        return;
+    }
+
+    if (format == MESH_VERTEX_HALF) {
+        uint16_t v[4] = {float_to_half(position[0]),
+                         float_to_half(position[1]),
+                         float_to_half(position[2]), 0x3c00}; // w = 1
+        memcpy(p, v, sizeof(v));
+    } else {
+        int16_t v[4] = {float_to_snorm16(position[0]),
+                        float_to_snorm16(position[1]),
+                        float_to_snorm16(position[2]), 32767};
+        memcpy(p, v, sizeof(v));
+    }
+    uint8_t c[4] = {float_to_unorm8(color[0]), float_to_unorm8(color[1]),
+                    float_to_unorm8(color[2]), 255};
+    memcpy(p + vertex_layouts[format].color_offset, c, sizeof(c));
+}
+
+#endif
@@ -0,0 +1,445 @@
+#define _POSIX_C_SOURCE 200809L
+
+// Converts a Wavefront OBJ file into the .mesh format that --mesh streams.
+// Only positions, optional vertex colors ("v x y z r g b") and faces are
+// read. Faces are triangulated as fans and reordered for the post-transform
+// vertex cache. Vertices are then renumbered in order of first use and the
+// triangles split into chunks, so that every chunk only refers to vertices
+// of itself and the chunks before it.
+
+#include <assert.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mesh_format.h"
+#include "vertex_format.h"
+
+#define DEFAULT_CHUNK_TRIANGLES 16384
+#define CACHE_SIZE 16 // vertices, a guess that suits most GPUs
+
+struct vertex {
+    float position[3];
+    float color[3];
+};
+
+#define ARRAY(type)                                                            \
+    struct {                                                                   \
+        type *data;                                                            \
+        size_t count, capacity;                                                \
+    }
+
+#define PUSH(array, value)                                                     \
+    do {                                                                       \
+        if ((array).count == (array).capacity) {                               \
+            (array).capacity = (array).capacity ? 2 * (array).capacity : 1024; \
+            (array).data = realloc((array).data, (array).capacity *            \
+                                                     sizeof(*(array).data));   \
+            assert((array).data);                                              \
+        }                                                                      \
+        (array).data[(array).count++] = (value);                               \
+    } while (0)
+
+static ARRAY(struct vertex) vertices;
+static ARRAY(uint32_t) indices;
+static ARRAY(struct mesh_chunk) chunks;
+
+// Resolves an OBJ index, which is 1-based or negative from the end.
+static bool resolve(long index, uint32_t *out) {
+    if (index < 0)
+        index += (long)vertices.count;
+    else
+        index -= 1;
+    if (index < 0 || (size_t)index >= vertices.count)
+        return false;
+    *out = index;
+    return true;
+}
+
+static bool read_obj(FILE *f, const char *path) {
+    char *line = NULL;
+    size_t size = 0;
+    unsigned long number = 0;
+    bool ok = true;
+
+    while (ok && getline(&line, &size, f) >= 0) {
+        number++;
+        char *p = line;
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            struct vertex v = {.color = {1.0f, 1.0f, 1.0f}};
+            int n = sscanf(p + 2, "%f %f %f %f %f %f", &v.position[0],
+                           &v.position[1], &v.position[2], &v.color[0],
+                           &v.color[1], &v.color[2]);
+            ok = n == 3 || n == 6;
+            PUSH(vertices, v);
+        } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            // v, v/vt, v//vn or v/vt/vn, only v matters
+            uint32_t face[3];
+            int corners = 0;
+            p += 2;
+            for (;;) {
+                char *end;
+                long index = strtol(p, &end, 10);
+                if (end == p)
+                    break;
+                p = end + strcspn(end, " \t\r\n");
+                if (!resolve(index, &face[corners < 2 ? corners : 2])) {
+                    ok = false;
+                    break;
+                }
+                if (++corners >= 3) {
+                    PUSH(indices, face[0]);
+                    PUSH(indices, face[1]);
+                    PUSH(indices, face[2]);
+                    face[1] = face[2];
+                }
+            }
+            ok = ok && corners >= 3;
+        }
+    }
+    if (!ok)
+        fprintf(stderr, "%s:%lu: malformed line\n", path, number);
+    free(line);
+    return ok;
+}
+
+// Centers the mesh and scales it into the unit cube around the built-in
+// triangle, flipping y since Vulkan's clip space points down.
+static void normalize(void) {
+    float min[3] = {INFINITY, INFINITY, INFINITY};
+    float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+    for (size_t i = 0; i < vertices.count; i++)
+        for (int c = 0; c < 3; c++) {
+            min[c] = fminf(min[c], vertices.data[i].position[c]);
+            max[c] = fmaxf(max[c], vertices.data[i].position[c]);
+        }
+    float extent =
+        fmaxf(fmaxf(max[0] - min[0], max[1] - min[1]), max[2] - min[2]);
+    float scale = extent > 0 ? 1.0f / extent : 1.0f;
+
+    for (size_t i = 0; i < vertices.count; i++) {
+        float *p = vertices.data[i].position;
+        for (int c = 0; c < 3; c++)
+            p[c] = (p[c] - (min[c] + max[c]) / 2) * scale;
+        p[1] = -p[1];
+    }
+}
+
+// Returns the vertex to fan around next: the candidate that stays in the
+// cache longest while still having triangles left, else a vertex from the
+// dead-end stack, else the next vertex with live triangles in input order.
+static int64_t next_vertex(const uint32_t *candidates, size_t candidate_count,
+                           const uint32_t *live, const uint64_t *stamps,
+                           uint64_t time, uint32_t **dead_end,
+                           const uint32_t *dead_end_base, size_t *cursor) {
+    int64_t best = -1;
+    uint64_t best_priority = 0;
+
+    for (size_t i = 0; i < candidate_count; i++) {
+        uint32_t v = candidates[i];
+        if (!live[v])
+            continue;
+        // vertices that would be evicted before their fan is done rank last
+        uint64_t priority = 0;
+        if (time - stamps[v] + 2 * live[v] <= CACHE_SIZE)
+            priority = time - stamps[v];
+        if (best < 0 || priority > best_priority) {
+            best = v;
+            best_priority = priority;
+        }
+    }
+    if (best >= 0)
+        return best;
+
+    while (*dead_end > dead_end_base) {
+        uint32_t v = *--*dead_end;
+        if (live[v])
+            return v;
+    }
+    for (; *cursor < vertices.count; ++*cursor)
+        if (live[*cursor])
+            return *cursor;
+    return -1;
+}
+
+// Tipsify (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex
+// Locality and Reduced Overdraw"): emits all remaining triangles around one
+// vertex at a time, picking the next vertex among those just emitted.
+// Linear in the number of triangles.
+static void reorder_triangles(void) {
+    size_t triangle_count = indices.count / 3;
+    uint32_t *live = calloc(vertices.count, sizeof(*live));
+    uint64_t *offsets = calloc(vertices.count + 1, sizeof(*offsets));
+    uint64_t *stamps = calloc(vertices.count, sizeof(*stamps));
+    uint32_t *adjacency = malloc(indices.count * sizeof(*adjacency));
+    uint32_t *dead_end_base = malloc(indices.count * sizeof(*dead_end_base));
+    uint32_t *candidates = malloc(indices.count * sizeof(*candidates));
+    bool *emitted = calloc(triangle_count, sizeof(*emitted));
+    uint32_t *out = malloc(indices.count * sizeof(*out));
+    assert(live && offsets && stamps && adjacency && dead_end_base &&
+           candidates && emitted && out);
+
+    // triangles around each vertex, as a CSR table
+    for (size_t i = 0; i < indices.count; i++)
+        live[indices.data[i]]++;
+    for (size_t v = 0; v < vertices.count; v++)
+        offsets[v + 1] = offsets[v] + live[v];
+    for (size_t i = 0; i < indices.count; i++)
+        adjacency[offsets[indices.data[i]]++] = i / 3;
+    for (size_t v = vertices.count; v > 0; v--)
+        offsets[v] = offsets[v - 1];
+    offsets[0] = 0;
+
+    uint32_t *dead_end = dead_end_base;
+    uint64_t time = CACHE_SIZE + 1;
+    size_t out_count = 0, cursor = 0;
+    int64_t fan = vertices.count ? 0 : -1;
+
+    while (fan >= 0) {
+        size_t candidate_count = 0;
+        for (uint64_t a = offsets[fan]; a < offsets[fan + 1]; a++) {
+            uint32_t t = adjacency[a];
+            if (emitted[t])
+                continue;
+            emitted[t] = true;
+            for (int c = 0; c < 3; c++) {
+                uint32_t v = indices.data[3 * t + c];
+                out[out_count++] = v;
+                *dead_end++ = v;
+                candidates[candidate_count++] = v;
+                live[v]--;
+                if (time - stamps[v] > CACHE_SIZE)
+                    stamps[v] = time++;
+            }
+        }
+        fan = next_vertex(candidates, candidate_count, live, stamps, time,
+                          &dead_end, dead_end_base, &cursor);
+    }
+    assert(out_count == indices.count);
+
+    free(indices.data);
+    indices.data = out;
+    indices.capacity = indices.count;
+    free(live);
+    free(offsets);
+    free(stamps);
+    free(adjacency);
+    free(dead_end_base);
+    free(candidates);
+    free(emitted);
+}
+
+// Renumbers vertices by first use, dropping unused ones, and cuts the
+// triangles into chunks. With that order the vertices new to a chunk are
+// one contiguous range right after those of the previous chunk.
+static void build_chunks(uint32_t chunk_triangles) {
+    uint32_t *remap = malloc(vertices.count * sizeof(*remap));
+    struct vertex *ordered = malloc(vertices.count * sizeof(*ordered));
+    assert(remap && ordered);
+    memset(remap, 0xff, vertices.count * sizeof(*remap));
+
+    uint32_t used = 0;
+    for (size_t first = 0; first < indices.count;) {
+        size_t end = first + 3 * (size_t)chunk_triangles;
+        if (end > indices.count)
+            end = indices.count;
+
+        uint32_t first_vertex = used;
+        for (size_t i = first; i < end; i++) {
+            uint32_t *index = &indices.data[i];
+            if (remap[*index] == UINT32_MAX) {
+                ordered[used] = vertices.data[*index];
+                remap[*index] = used++;
+            }
+            *index = remap[*index];
+        }
+        PUSH(chunks, ((struct mesh_chunk){
+                         .first_vertex = first_vertex,
+                         .vertex_count = used - first_vertex,
+                         .first_index = first,
+                         .index_count = end - first,
+                     }));
+        first = end;
+    }
+
+    free(vertices.data);
+    free(remap);
+    vertices.data = ordered;
+    vertices.count = vertices.capacity = used;
+}
+
+static uint64_t align(uint64_t offset) {
+    return (offset + MESH_ALIGNMENT - 1) / MESH_ALIGNMENT * MESH_ALIGNMENT;
+}
+
+static bool pad_to(FILE *f, uint64_t offset) {
+    static const char zeros[MESH_ALIGNMENT];
+    long pos = ftell(f);
+    return pos >= 0 && (uint64_t)pos <= offset &&
+           fwrite(zeros, 1, offset - pos, f) == offset - pos;
+}
+
+static bool write_mesh(FILE *f, enum mesh_vertex_format format) {
+    uint32_t stride = vertex_layouts[format].stride;
+    uint32_t index_size = vertices.count <= UINT16_MAX + 1 ? 2 : 4;
+    struct mesh_header header = {
+        .magic = MESH_MAGIC,
+        .version = MESH_VERSION,
+        .vertex_format = format,
+        .vertex_stride = stride,
+        .index_size = index_size,
+        .vertex_count = vertices.count,
+        .index_count = indices.count,
+        .chunk_count = chunks.count,
+        .chunk_offset = sizeof(header),
+    };
+    header.vertex_offset =
+        align(header.chunk_offset + chunks.count * sizeof(struct mesh_chunk));
+    header.index_offset =
+        align(header.vertex_offset + vertices.count * stride);
+
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(chunks.data, sizeof(*chunks.data), chunks.count, f) !=
+            chunks.count ||
+        !pad_to(f, header.vertex_offset))
+        return false;
+
+    for (size_t i = 0; i < vertices.count; i++) {
+        uint8_t packed[sizeof(struct vertex)];
+        pack_vertex(format, vertices.data[i].position, vertices.data[i].color,
+                    packed);
+        if (fwrite(packed, stride, 1, f) != 1)
+            return false;
+    }
+
+    if (!pad_to(f, header.index_offset))
+        return false;
+    if (index_size == 4)
+        return fwrite(indices.data, sizeof(*indices.data), indices.count,
+                      f) == indices.count;
+    for (size_t i = 0; i < indices.count; i++) {
+        uint16_t index = indices.data[i];
+        if (fwrite(&index, sizeof(index), 1, f) != 1)
+            return false;
+    }
+    return true;
+}
+
+static bool parse_format(const char *name, enum mesh_vertex_format *format) {
+    for (size_t i = 0; i < sizeof(vertex_layouts) / sizeof(*vertex_layouts);
+         i++) {
+        if (strcmp(vertex_layouts[i].name, name) == 0) {
+            *format = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] INPUT.obj OUTPUT.mesh\n"
+            "  --chunk-triangles N\n"
+            "                   triangles per streamed chunk (default: %d)\n"
+            "  --no-normalize   keep the positions as they are instead of\n"
+            "                   fitting them into the unit cube\n"
+            "  --no-reorder     keep the triangle order of the input\n"
+            "  --vertex-format FORMAT\n"
+            "                   float32, half or snorm16, must match the\n"
+            "                   renderer's build (default: %s)\n",
+            prog, DEFAULT_CHUNK_TRIANGLES, VERTEX_FORMAT_NAME);
+}
+
+int main(int argc, char *argv[]) {
+    enum {
+        OPT_CHUNK_TRIANGLES = 256,
+        OPT_NO_NORMALIZE,
+        OPT_NO_REORDER,
+        OPT_VERTEX_FORMAT,
+    };
+    static const struct option long_options[] = {
+        {"chunk-triangles", required_argument, NULL, OPT_CHUNK_TRIANGLES},
+        {"no-normalize", no_argument, NULL, OPT_NO_NORMALIZE},
+        {"no-reorder", no_argument, NULL, OPT_NO_REORDER},
+        {"vertex-format", required_argument, NULL, OPT_VERTEX_FORMAT},
+        {"help", no_argument, NULL, 'h'},
+        {0},
+    };
+    uint32_t chunk_triangles = DEFAULT_CHUNK_TRIANGLES;
+    bool normalized = true, reordered = true;
+    enum mesh_vertex_format format = VERTEX_FORMAT;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_CHUNK_TRIANGLES:
+            chunk_triangles = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_NO_NORMALIZE:
+            normalized = false;
+            break;
+        case OPT_NO_REORDER:
+            reordered = false;
+            break;
+        case OPT_VERTEX_FORMAT:
+            if (!parse_format(optarg, &format)) {
+                fprintf(stderr, "unknown vertex format '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2 || chunk_triangles == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *in_path = argv[optind], *out_path = argv[optind + 1];
+
+    FILE *in = fopen(in_path, "r");
+    if (!in) {
+        perror(in_path);
+        return EXIT_FAILURE;
+    }
+    bool ok = read_obj(in, in_path);
+    fclose(in);
+    if (!ok)
+        return EXIT_FAILURE;
+    if (indices.count > UINT32_MAX || vertices.count > UINT32_MAX) {
+        fprintf(stderr, "%s: more than 2^32 indices or vertices\n", in_path);
+        return EXIT_FAILURE;
+    }
+
+    if (normalized)
+        normalize();
+    if (reordered)
+        reorder_triangles();
+    build_chunks(chunk_triangles);
+
+    FILE *out = fopen(out_path, "wb");
+    if (!out) {
+        perror(out_path);
+        return EXIT_FAILURE;
+    }
+    ok = write_mesh(out, format);
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+        perror(out_path);
+        return EXIT_FAILURE;
+    }
+
+    printf("%s: %zu %s vertices, %zu triangles in %zu chunks\n", out_path,
+           vertices.count, vertex_layouts[format].name, indices.count / 3,
+           chunks.count);
+    return EXIT_SUCCESS;
+}